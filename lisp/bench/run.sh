@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# Runs the benchmarks in this directory and reports, for each, the
+# median and 95th percentile of the wall time over a number of runs,
+# and the allocations and peak RSS that `--stats` counted.
+#
+# usage: run.sh [-n RUNS] [-t TEK] [-a ARGS] [-s FILE] [-c FILE] [BENCH...]
+#
+#   -n RUNS   run each benchmark RUNS times (10)
+#   -t TEK    the interpreter to run ($TEK, or tek from the PATH)
+#   -a ARGS   more arguments for the interpreter, like --vm
+#   -s FILE   save the results to FILE as a baseline
+#   -c FILE   compare the results with the baseline saved in FILE
+#
+# The benchmarks are the .tek files given, or all of those next to
+# this script. Times are in milliseconds.
+
+runs=10
+tek=${TEK:-tek}
+args=
+save=
+base=
+
+while getopts n:t:a:s:c: opt; do
+	case $opt in
+	n) runs=$OPTARG ;;
+	t) tek=$OPTARG ;;
+	a) args=$OPTARG ;;
+	s) save=$OPTARG ;;
+	c) base=$OPTARG ;;
+	*) sed -n '/^# usage/,/^# this/p' "$0" | sed 's/^# \{0,1\}//' >&2
+	   exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -eq 0 ]; then
+	set -- "$(dirname "$0")"/*.tek
+fi
+
+if [ -n "$base" ] && [ ! -r "$base" ]; then
+	echo "run.sh: can't read baseline \`$base'" >&2
+	exit 2
+fi
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+: > "$tmp/results"
+status=0
+
+printf '%-10s %9s %9s %12s %9s' bench median p95 allocs rss_kb
+[ -n "$base" ] && printf ' %9s %7s' base change
+printf '\n'
+
+for b in "$@"; do
+	name=$(basename "$b" .tek)
+	: > "$tmp/times"
+	failed=
+
+	i=0
+	while [ $i -lt "$runs" ]; do
+		start=$(date +%s%N)
+		# shellcheck disable=SC2086
+		"$tek" $args --stats "$b" > /dev/null 2> "$tmp/stats" \
+			|| failed=1
+		end=$(date +%s%N)
+		echo $(((end - start) / 1000)) >> "$tmp/times"
+		i=$((i + 1))
+	done
+
+	if [ -n "$failed" ]; then
+		printf '%-10s failed\n' "$name"
+		status=1
+		continue
+	fi
+
+	allocs=$(awk '$1 == "gc.allocations" { print $2 }' "$tmp/stats")
+	rss=$(awk '$1 == "rss.peak_kb" { print $2 }' "$tmp/stats")
+
+	# The median and the 95th percentile, from the microseconds.
+	sort -n "$tmp/times" | awk '
+		{ t[NR] = $1 }
+		END {
+			p = int(NR * 0.95); if (p < NR * 0.95) p++
+			printf "%.2f %.2f\n", t[int((NR + 1) / 2)] / 1000, t[p] / 1000
+		}' > "$tmp/summary"
+	read -r median p95 < "$tmp/summary"
+
+	printf '%-10s %9s %9s %12s %9s' "$name" "$median" "$p95" "$allocs" "$rss"
+	echo "$name $median $p95 $allocs $rss" >> "$tmp/results"
+
+	if [ -n "$base" ]; then
+		awk -v n="$name" -v m="$median" '
+			$1 == n { printf " %9s %+6.1f%%", $2, (m / $2 - 1) * 100; f = 1 }
+			END { if (!f) printf " %9s %7s", "-", "-" }' "$base"
+	fi
+
+	printf '\n'
+done
+
+[ -n "$save" ] && cp "$tmp/results" "$save"
+
+exit $status
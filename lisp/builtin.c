@@ -1,20 +1,241 @@
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 
 #include "eval.h"
 #include "util.h"
 #include "error.h"
+#include "gc.h"
 #include "builtin.h"
+#include "regex.h"
+#include "hash.h"
+#include "rope.h"
+#include "seq.h"
+
+/*
+ * The resolver. Symbols in the body of a function that name one of
+ * its parameters, or a parameter of a function that it's nested in,
+ * are replaced with `VAL_LOCAL` references giving the frame (counting
+ * up from the function's own) and the slot that the variable will be
+ * found in, so that using them doesn't involve a search.
+ *
+ * Quoted data is left alone, and so are the arguments of macros,
+ * which might not be code at all. Nested functions are resolved when
+ * they're created. The body is copied wherever something is rewritten
+ * because it may be shared with other code, like a template quoted
+ * inside of a macro.
+ */
+
+struct resolver {
+	struct value *param;   /* Parameters of the function.       */
+	struct value *scope;   /* Enclosing frames, or NULL.        */
+	struct value *env;     /* Environment it's created in.      */
+	struct value *defs;    /* Names the body defines with `fn`. */
+	struct value *self;    /* Name of the function, or nil.     */
+};
+
+static bool
+memq(struct value *list, struct value *v)
+{
+	for (; TYPE(list) == VAL_CELL; list = list->cdr)
+		if (list->car == v) return true;
+	return false;
+}
+
+static bool
+locate(struct resolver *r,
+       struct value *sym,
+       unsigned *depth,
+       unsigned *index)
+{
+	struct value *names = r->param, *frame = r->scope;
+
+	for (unsigned d = 0;; d++) {
+		unsigned i = 0;
+		struct value *p = names;
+
+		for (; TYPE(p) == VAL_CELL; p = p->cdr, i++)
+			if (p->car == sym) break;
+
+		if (TYPE(p) == VAL_CELL || p == sym) {
+			/*
+			 * A nested definition would go in this
+			 * function's own frame and hide an outer one.
+			 */
+
+			if (d && memq(r->defs, sym)) return false;
+			return *depth = d, *index = i, true;
+		}
+
+		/*
+		 * Stop at the global environment, or at any frame that
+		 * has picked up a binding for the name at runtime.
+		 */
+
+		if (!frame || !frame->up) return false;
+
+		for (struct value *c = frame->vars;
+		     TYPE(c) != VAL_NIL;
+		     c = c->cdr)
+			if (c->car->car == sym) return false;
+
+		names = frame->names;
+		frame = frame->up;
+	}
+}
+
+/*
+ * Returns the builtin or macro that the head of a form refers to, if
+ * it refers to one that we can know about ahead of time.
+ */
+
+static struct value *
+head_value(struct resolver *r, struct value *head)
+{
+	unsigned depth, index;
+
+	if (TYPE(head) != VAL_SYMBOL) return NULL;
+	if (locate(r, head, &depth, &index)) return NULL;
+
+	struct value **bind = find(r->env, head);
+	if (!bind) return NULL;
+	if (TYPE(*bind) == VAL_MACRO) return *bind;
+	if (TYPE(*bind) == VAL_BUILTIN) return *bind;
+
+	return NULL;
+}
+
+/*
+ * Whether `head` is a symbol that isn't bound to anything yet, other
+ * than the name of the function itself. It might be defined as a macro
+ * before the form is run, so the form's arguments are left alone.
+ */
+
+static bool
+unbound(struct resolver *r, struct value *head)
+{
+	unsigned depth, index;
+
+	return TYPE(head) == VAL_SYMBOL && head != r->self
+		&& !locate(r, head, &depth, &index)
+		&& !find(r->env, head);
+}
+
+static bool
+is_special(struct value *head)
+{
+	return head && TYPE(head) == VAL_BUILTIN
+		&& (head->prim == builtin_quote
+		    || head->prim == builtin_fn
+		    || head->prim == builtin_macro);
+}
+
+/*
+ * Collects the names defined by `fn` and `macro` forms in `v`.
+ */
+
+static void
+find_defs(struct resolver *r, struct value *v)
+{
+	if (TYPE(v) != VAL_CELL) return;
+	PROTECT(&v);
+
+	struct value *head = head_value(r, v->car);
+
+	if (is_special(head)) {
+		if (head->prim != builtin_quote
+		    && TYPE(v->cdr) == VAL_CELL
+		    && TYPE(v->cdr->car) == VAL_SYMBOL)
+			r->defs = cons(v->cdr->car, r->defs);
+		return;
+	}
+
+	if (head && TYPE(head) == VAL_MACRO) return;
+
+	for (; TYPE(v) == VAL_CELL; v = v->cdr)
+		find_defs(r, v->car);
+}
+
+static struct value *rewrite_list(struct resolver *r, struct value *l);
+
+static struct value *
+rewrite(struct resolver *r, struct value *v)
+{
+	if (TYPE(v) != VAL_CELL) return v;
+
+	struct value *head = head_value(r, v->car);
+	if (is_special(head)) return v;
+	if (head && TYPE(head) == VAL_MACRO) return v;
+	if (!head && unbound(r, v->car)) return v;
+
+	return rewrite_list(r, v);
+}
+
+static struct value *
+rewrite_list(struct resolver *r, struct value *l)
+{
+	if (TYPE(l) != VAL_CELL) return l;
+
+	struct value *car = l->car, *cdr = NULL;
+	unsigned depth, index;
+	PROTECT(&l, &car, &cdr);
+
+	if (TYPE(car) == VAL_SYMBOL && locate(r, car, &depth, &index)) {
+		car = new_value(VAL_LOCAL, l->loc);
+		car->name  = l->car;
+		car->depth = depth;
+		car->index = index;
+	} else {
+		car = rewrite(r, car);
+	}
+
+	cdr = rewrite_list(r, l->cdr);
+	if (car == l->car && cdr == l->cdr) return l;
+
+	struct value *c = cons(car, cdr);
+	c->loc = l->loc;
+
+	return c;
+}
+
+/*
+ * Resolves the body of a function named `name`, or nil, with the
+ * parameters `param` created in `env`. Macros are called in the
+ * environment they're used in rather than the one they were defined
+ * in, so for them `scope` is NULL and only their own parameters are
+ * resolved.
+ */
+
+static struct value *
+resolve(struct value *env,
+        struct value *scope,
+        struct value *name,
+        struct value *param,
+        struct value *body)
+{
+	struct resolver r = { param, scope, env, Nil, name };
+	struct value *p = body;
+	PROTECT(&r.param, &r.scope, &r.env, &r.defs, &r.self, &body, &p);
+
+	for (; TYPE(p) == VAL_CELL; p = p->cdr)
+		find_defs(&r, p->car);
+
+	return rewrite_list(&r, body);
+}
 
 /*
  * Verifies that `v` is a well-formed function and returns a new
  * function value built from it. `v->car` is the list of parameters
- * and `v->cdr` is the body of the function.
+ * and `v->cdr` is the body of the function. `name` is what it's
+ * going to be called, or nil.
  */
 
 static struct value *
-make_function(struct value *env, struct value *v, int type)
+make_function(struct value *env,
+              struct value *name,
+              struct value *v,
+              int type)
 {
 	assert(type == VAL_FUNCTION || type == VAL_MACRO);
 
@@ -22,22 +243,28 @@ make_function(struct value *env, struct value *v, int type)
 		error(v->loc, "malformed function definition");
 
 	for (struct value *p = v->car;
-	     p->type == VAL_CELL;
+	     TYPE(p) == VAL_CELL;
 	     p = p->cdr) {
-		if (p->car->type == VAL_SYMBOL) continue;
-		return error(p->car->loc,
+		if (TYPE(p->car) == VAL_SYMBOL) continue;
+		return error(p->loc,
 		             "parameter name must be a symbol"
 		             " (this is %s %s)",
-		             IS_VOWEL(*TYPE_NAME(p->car->type))
+		             IS_VOWEL(*TYPE_NAME(TYPE(p->car)))
 		             ? "an" : "a",
-		             TYPE_NAME(p->car->type));
+		             TYPE_NAME(TYPE(p->car)));
 	}
 
-	struct value *r = new_value(v->cdr->loc);
+	PROTECT(&env, &name, &v);
+	struct value *body = resolve(env,
+	                             type == VAL_FUNCTION ? env : NULL,
+	                             type == VAL_FUNCTION ? name : Nil,
+	                             v->car,
+	                             v->cdr);
+	PROTECT(&body);
+	struct value *r = new_value(type, v->cdr->loc);
 
-	r->type  = type;
 	r->param = v->car;
-	r->body  = v->cdr;
+	r->body  = body;
 	r->env   = env;
 
 	return r;
@@ -50,7 +277,7 @@ make_function(struct value *env, struct value *v, int type)
 struct value *
 builtin_fn(struct value *env, struct value *v)
 {
-	if (v->cdr->type != VAL_CELL)
+	if (TYPE(v->cdr) != VAL_CELL)
 		return error(v->loc, "missing list of parameters");
 
 	/*
@@ -58,31 +285,47 @@ builtin_fn(struct value *env, struct value *v)
 	 * function.
 	 */
 
-	if (v->car->type != VAL_SYMBOL)
-		return make_function(env, v, VAL_FUNCTION);
+	if (TYPE(v->car) != VAL_SYMBOL)
+		return make_function(env, Nil, v, VAL_FUNCTION);
 
 	/*
 	 * Otherwise it's obviously a named function which should be
 	 * added to the environment as a variable.
 	 */
 
-	return add_variable(env,
-	                    v->car,
-	                    make_function(env, v->cdr, VAL_FUNCTION));
+	struct value *fn = NULL;
+	PROTECT(&env, &v, &fn);
+	fn = make_function(env, v->car, v->cdr, VAL_FUNCTION);
+	add_variable(env, v->car, fn);
+	note_binding(env, v->car, v->loc);
+
+	return fn;
 }
 
 /*
- * Evaluates each expression in `list` and prints it to stdout.
+ * Returns the location to blame for a bad argument `v` to a builtin
+ * called at `loc`; integers and nil don't know where they came from.
+ */
+
+static location
+arg_loc(location loc, struct value *v)
+{
+	return IS_INT(v) || !v->loc ? loc : v->loc;
+}
+
+/*
+ * Prints each of its arguments to `output`.
  */
 
 struct value *
-builtin_print(struct value *env, struct value *list)
+builtin_print(struct value *env,
+              location loc,
+              unsigned argc,
+              struct value **argv)
 {
-	struct value *r = eval_list(env, list);
-	if (r->type == VAL_ERROR) return r;
-	for (struct value *p = r; p->type != VAL_NIL; p = p->cdr) {
-		struct value *e = print_value(stdout, p->car);
-		if (e->type == VAL_ERROR) return e;
+	for (unsigned i = 0; i < argc; i++) {
+		struct value *e = print_value(output, argv[i]);
+		if (TYPE(e) == VAL_ERROR) return e;
 	}
 	return Nil;
 }
@@ -90,125 +333,137 @@ builtin_print(struct value *env, struct value *list)
 struct value *
 builtin_set(struct value *env, struct value *list)
 {
-	struct value *sym = eval(env, list->car);
-	struct value *bind = find(env, sym);
+	struct value *sym = NULL;
+	PROTECT(&env, &list, &sym);
 
-	if (!bind) {
-		struct value *value = eval(env, list->cdr->car);
-		add_variable(env, sym, value);
-		return value;
-	}
+	sym = eval(env, list->car);
+	if (TYPE(sym) == VAL_ERROR) return sym;
 
 	struct value *value = eval(env, list->cdr->car);
-	bind->cdr = value;
+	if (TYPE(value) == VAL_ERROR) return value;
+
+	/* A local variable that `resolve()` has already found. */
+	if (TYPE(sym) == VAL_LOCAL) return assign(local(env, sym), value);
+
+	PROTECT(&value);
+	struct value **bind = find(env, sym);
+	if (bind) assign(bind, value);
+	else add_variable(env, sym, value);
+	note_binding(env, sym, list->loc);
 
 	return value;
 }
 
+/*
+ * The arithmetic builtins fold their arguments from left to right.
+ * Two integers, by far the most common case, are handled before
+ * bothering with the loop.
+ */
+
 #define ARITHMETIC(X)	  \
-	int sum = 0, first = 1; \
-	for (struct value *args = eval_list(env, list); \
-	     args->type != VAL_NIL; \
-	     args = args->cdr) { \
-		if (args->type == VAL_ERROR) return args; \
-		if (args->car->type == VAL_INT) { \
-			if (first) { \
-				sum = args->car->i; \
-				first = 0; \
-			} \
-			else sum X##= args->car->i; \
+	if (argc == 2 && IS_INT(argv[0]) && IS_INT(argv[1])) \
+		return MAKE_INT(INT(argv[0]) X INT(argv[1])); \
+	intptr_t sum = 0; \
+	for (unsigned i = 0; i < argc; i++) { \
+		if (IS_INT(argv[i])) { \
+			if (!i) sum = INT(argv[i]); \
+			else sum X##= INT(argv[i]); \
 			continue; \
 		} \
-		return error(args->car->loc, \
+		return error(arg_loc(loc, argv[i]), \
 		             "builtin `"#X"' takes only " \
 		             "numeric arguments (got `%s')", \
-		             TYPE_NAME(args->car->type)); \
+		             TYPE_NAME(TYPE(argv[i]))); \
 	} \
-	struct value *r = new_value(list->loc); \
-	r->type = VAL_INT; \
-	r->i = sum; \
-	return r;
+	return MAKE_INT(sum);
 
 struct value *
-builtin_add(struct value *env, struct value *list)
+builtin_add(struct value *env,
+            location loc,
+            unsigned argc,
+            struct value **argv)
 {
 	ARITHMETIC(+);
 }
 
 struct value *
-builtin_sub(struct value *env, struct value *list)
+builtin_sub(struct value *env,
+            location loc,
+            unsigned argc,
+            struct value **argv)
 {
 	ARITHMETIC(-);
 }
 
 struct value *
-builtin_mul(struct value *env, struct value *list)
+builtin_mul(struct value *env,
+            location loc,
+            unsigned argc,
+            struct value **argv)
 {
 	ARITHMETIC(*);
 }
 
 struct value *
-builtin_div(struct value *env, struct value *list)
+builtin_div(struct value *env,
+            location loc,
+            unsigned argc,
+            struct value **argv)
 {
 	ARITHMETIC(/);
 }
 
-struct value *
-builtin_eq(struct value *env, struct value *list)
-{
-	int sum = 0, first = 1;
-
-	for (struct value *args = eval_list(env, list);
-	     args->type != VAL_NIL;
-	     args = args->cdr) {
-		if (args->type == VAL_ERROR) return args;
-
-		if (args->car->type == VAL_INT) {
-			if (first) sum = args->car->i, first = 0;
-			else if (args->car->i != sum)
-				return Nil;
-			continue;
-		}
-
-		return error(args->car->loc,
-		             "builtin `=' takes only numeric"
-		             " arguments (got `%s')",
-		             TYPE_NAME(args->car->type));
-	}
+/*
+ * Like the arithmetic builtins, but `X` is a condition on `sum`, the
+ * first argument, and `n`, the current one, that has to hold for all
+ * of the rest.
+ */
 
+#define COMPARISON(NAME, X)	  \
+	if (argc == 2 && IS_INT(argv[0]) && IS_INT(argv[1])) { \
+		intptr_t sum = INT(argv[0]), n = INT(argv[1]); \
+		return (X) ? True : Nil; \
+	} \
+	intptr_t sum = 0; \
+	for (unsigned i = 0; i < argc; i++) { \
+		if (!IS_INT(argv[i])) \
+			return error(arg_loc(loc, argv[i]), \
+			             "builtin `"NAME"' takes only numeric" \
+			             " arguments (got `%s')", \
+			             TYPE_NAME(TYPE(argv[i]))); \
+		intptr_t n = INT(argv[i]); \
+		if (!i) sum = n; \
+		else if (!(X)) return Nil; \
+	} \
 	return True;
-}
 
 struct value *
-builtin_less(struct value *env, struct value *v)
+builtin_eq(struct value *env,
+           location loc,
+           unsigned argc,
+           struct value **argv)
 {
-	int sum = 0, first = 1;
-
-	for (struct value *args = eval_list(env, v);
-	     args->type != VAL_NIL;
-	     args = args->cdr) {
-		if (args->type == VAL_ERROR) return args;
-
-		if (args->car->type == VAL_INT) {
-			if (first) sum = args->car->i, first = 0;
-			else if (args->car->i >= sum)
-				return Nil;
-			continue;
-		}
-
-		return error(args->car->loc,
-		             "builtin `<' takes only numeric"
-		             " arguments (got `%s')",
-		             TYPE_NAME(args->car->type));
-	}
+	COMPARISON("=", n == sum);
+}
 
-	return True;
+struct value *
+builtin_less(struct value *env,
+             location loc,
+             unsigned argc,
+             struct value **argv)
+{
+	COMPARISON("<", n < sum);
 }
 
 struct value *
 builtin_if(struct value *env, struct value *list)
 {
-	if (eval(env, list->car)->type == VAL_TRUE)
+	PROTECT(&env, &list);
+
+	struct value *c = eval(env, list->car);
+	if (TYPE(c) == VAL_ERROR) return c;
+
+	if (TYPE(c) == VAL_TRUE)
 		return eval(env, list->cdr->car);
 
 	/* Otherwise do the else branches. */
@@ -225,46 +480,95 @@ builtin_quote(struct value *env, struct value *v)
 struct value *
 builtin_setq(struct value *env, struct value *list)
 {
-	return builtin_set(env, cons(quote(list->car), list->cdr));
+	PROTECT(&env, &list);
+	struct value *q = quote(list->car);
+	struct value *args = cons(q, list->cdr);
+	args->loc = list->loc;
+
+	return builtin_set(env, args);
 }
 
 struct value *
-builtin_println(struct value *env, struct value *v)
+builtin_println(struct value *env,
+                location loc,
+                unsigned argc,
+                struct value **argv)
 {
-	struct value *r = builtin_print(env, v);
-	return putchar('\n'), r;
+	struct value *r = builtin_print(env, loc, argc, argv);
+	return fputc('\n', output), r;
 }
 
 struct value *
-builtin_cons(struct value *env, struct value *v)
+builtin_cons(struct value *env,
+             location loc,
+             unsigned argc,
+             struct value **argv)
 {
-	return cons(eval(env, v->car), eval(env, v->cdr->car));
+	return cons(argv[0], argv[1]);
+}
+
+/*
+ * Checks that the argument of `car' or `cdr' is a list.
+ */
+
+static struct value *
+list_arg(location loc, struct value *l, const char *name)
+{
+	if (IS_LIST(l)) return l;
+	return error(arg_loc(loc, l),
+	             "builtin `%s' requires a list argument"
+	             " (this is %s %s)", name,
+	             IS_VOWEL(*TYPE_NAME(TYPE(l))) ? "an" : "a",
+	             TYPE_NAME(TYPE(l)));
 }
 
 struct value *
-builtin_car(struct value *env, struct value *v)
+builtin_car(struct value *env,
+            location loc,
+            unsigned argc,
+            struct value **argv)
 {
-	return eval(env, v->car)->car;
+	struct value *l = list_arg(loc, argv[0], "car");
+	return TYPE(l) == VAL_CELL ? l->car : l;
 }
 
 struct value *
-builtin_cdr(struct value *env, struct value *v)
+builtin_cdr(struct value *env,
+            location loc,
+            unsigned argc,
+            struct value **argv)
 {
-	return eval(env, v->car)->cdr;
+	struct value *l = list_arg(loc, argv[0], "cdr");
+	return TYPE(l) == VAL_CELL ? l->cdr : l;
 }
 
 struct value *
 builtin_macro(struct value *env, struct value *v)
 {
-	return add_variable(env,
-	                    v->car,
-	                    make_function(env, v->cdr, VAL_MACRO));
+	struct value *mac = NULL;
+	PROTECT(&env, &v, &mac);
+	mac = make_function(env, v->car, v->cdr, VAL_MACRO);
+	add_variable(env, v->car, mac);
+	note_binding(env, v->car, v->loc);
+
+	return mac;
 }
 
 struct value *
-builtin_list(struct value *env, struct value *list)
+builtin_list(struct value *env,
+             location loc,
+             unsigned argc,
+             struct value **argv)
 {
-	return eval_list(env, list);
+	struct value *r = Nil;
+	PROTECT(&r);
+
+	for (unsigned i = argc; i; i--) {
+		struct value *c = cons(argv[i - 1], r);
+		r = c;
+	}
+
+	return r;
 }
 
 struct value *
@@ -276,147 +580,1006 @@ builtin_progn(struct value *env, struct value *v)
 struct value *
 builtin_while(struct value *env, struct value *v)
 {
-	struct value *c, *r;
+	struct value *c, *r = Nil;
+	PROTECT(&env, &v, &r);
 
-	while ((c = eval(env, v->car)) && c->type == VAL_TRUE) {
+	while ((c = eval(env, v->car)) && TYPE(c) == VAL_TRUE) {
 		r = progn(env, v->cdr);
-		if (r->type == VAL_ERROR) return r;
+		if (TYPE(r) == VAL_ERROR) return r;
 	}
 
+	return c && TYPE(c) == VAL_ERROR ? c : r;
+}
+
+static struct value *
+index_error(location loc, struct value *i, struct value *v)
+{
+	return error(arg_loc(loc, i), "index %jd is out of bounds for %s"
+	             " of length %u", (intmax_t)INT(i),
+	             IS_TEXT(v) ? "a string" : "an array",
+	             IS_TEXT(v) ? text_length(v) : v->num);
+}
+
+/*
+ * Returns the `i`th character of the string or rope `str`, as a
+ * string.
+ */
+
+static struct value *
+char_at(location loc, struct value *str, struct value *i)
+{
+	if (INT(i) < 0 || INT(i) >= text_length(str))
+		return index_error(loc, i, str);
+
+	if (TYPE(str) == VAL_ROPE)
+		return rope_substring(str, INT(i), INT(i) + 1);
+
+	kdgu *chr = kdgu_getchr(str->s, string_offset(str, INT(i)));
+	struct value *r = new_value(VAL_STRING, loc);
+	r->s = chr;
+
 	return r;
 }
 
 struct value *
-builtin_nth(struct value *env, struct value *v)
+builtin_nth(struct value *env,
+            location loc,
+            unsigned argc,
+            struct value **argv)
 {
-	if (v->type != VAL_CELL
-	    || v->cdr->type != VAL_CELL
-	    || v->cdr->cdr->type != VAL_NIL)
-		return error(v->loc,
-		             "builtin `nth' requires two arguments");
+	struct value *arr = argv[0], *i = argv[1];
 
-	struct value *i = eval(env, v->cdr->car);
-	if (i->type != VAL_INT)
-		return error(v->loc,
+	if (!IS_INT(i))
+		return error(loc,
 		             "builtin `nth' requires a numeric second"
 		             " argument");
 
-	struct value *arr = eval(env, v->car);
-	if (arr->type != VAL_ARRAY
-	    && !IS_LIST(v)
-	    && arr->type != VAL_STRING)
-		return error(v->loc,
-		             "builtin `nth' requires an array, list,"
-		             "or string argument (got %s)",
-		             " (this is %s %s)",
-		             IS_VOWEL(*TYPE_NAME(arr->type))
-		             ? "an" : "a",
-		             TYPE_NAME(arr->type));
+	if (IS_TEXT(arr)) return char_at(loc, arr, i);
+
+	if (TYPE(arr) == VAL_ARRAY) {
+		if (INT(i) < 0 || INT(i) >= arr->num)
+			return index_error(loc, i, arr);
+		return arr->arr[INT(i)];
+	}
+
+	if (IS_LIST(arr)) {
+		for (intptr_t j = 0; j < INT(i) && TYPE(arr) == VAL_CELL; j++)
+			arr = arr->cdr;
+		return TYPE(arr) == VAL_CELL ? arr->car : Nil;
+	}
+
+	return error(arg_loc(loc, arr),
+	             "builtin `nth' requires an array, list,"
+	             " or string argument (this is %s %s)",
+	             IS_VOWEL(*TYPE_NAME(TYPE(arr)))
+	             ? "an" : "a",
+	             TYPE_NAME(TYPE(arr)));
+}
+
+struct value *
+builtin_length(struct value *env,
+               location loc,
+               unsigned argc,
+               struct value **argv)
+{
+	struct value *arr = argv[0];
+
+	if (TYPE(arr) == VAL_ARRAY)
+		return MAKE_INT(arr->num);
+	if (TYPE(arr) == VAL_HASH)
+		return MAKE_INT(arr->num_key);
+	if (IS_LIST(arr))
+		return list_length(arr);
+	if (IS_TEXT(arr))
+		return MAKE_INT(text_length(arr));
+
+	return error(arg_loc(loc, arr),
+	             "builtin `length' takes a list, array,"
+	             " string, rope, or hash table argument"
+	             " (this is %s %s)",
+	             IS_VOWEL(*TYPE_NAME(TYPE(arr)))
+	             ? "an" : "a",
+	             TYPE_NAME(TYPE(arr)));
+}
+
+/*
+ * Checks that the argument `v` of the builtin `name` is an array.
+ */
+
+static struct value *
+array_arg(location loc, struct value *v, const char *name)
+{
+	if (TYPE(v) == VAL_ARRAY) return v;
+	return error(arg_loc(loc, v),
+	             "builtin `%s' requires an array argument"
+	             " (this is %s %s)", name,
+	             IS_VOWEL(*TYPE_NAME(TYPE(v))) ? "an" : "a",
+	             TYPE_NAME(TYPE(v)));
+}
+
+/*
+ * Makes a new array of its arguments. Unlike an array literal, which
+ * is one array made when it's read, this makes a fresh one every time.
+ */
+
+struct value *
+builtin_array(struct value *env,
+              location loc,
+              unsigned argc,
+              struct value **argv)
+{
+	struct value *arr = new_array(loc, argc);
+	memcpy(arr->arr, argv, argc * sizeof *argv);
+	return arr;
+}
+
+/*
+ * Appends a value to the end of an array, and returns the array.
+ */
+
+struct value *
+builtin_push(struct value *env,
+             location loc,
+             unsigned argc,
+             struct value **argv)
+{
+	struct value *arr = array_arg(loc, argv[0], "push");
+	if (TYPE(arr) == VAL_ERROR) return arr;
+	array_push(arr, argv[1]);
+	return arr;
+}
+
+/*
+ * Removes the last element of an array and returns it.
+ */
+
+struct value *
+builtin_pop(struct value *env,
+            location loc,
+            unsigned argc,
+            struct value **argv)
+{
+	struct value *arr = array_arg(loc, argv[0], "pop");
+	if (TYPE(arr) == VAL_ERROR) return arr;
+	if (!arr->num)
+		return error(arg_loc(loc, arr), "can't pop an empty array");
+	return arr->arr[--arr->num];
+}
+
+/*
+ * Replaces the element at an index of an array, and returns the new
+ * element.
+ */
+
+struct value *
+builtin_aset(struct value *env,
+             location loc,
+             unsigned argc,
+             struct value **argv)
+{
+	struct value *arr = array_arg(loc, argv[0], "aset"), *i = argv[1];
+	if (TYPE(arr) == VAL_ERROR) return arr;
+
+	if (!IS_INT(i))
+		return error(loc,
+		             "builtin `aset' requires a numeric second"
+		             " argument");
 
-	/* TODO: lists */
+	if (INT(i) < 0 || INT(i) >= arr->num)
+		return index_error(loc, i, arr);
 
-	if (arr->type == VAL_STRING) {
-		unsigned idx = 0;
+	return arr->arr[INT(i)] = argv[2];
+}
 
-		for (int j = 0; j < i->i; j++)
-			kdgu_next(arr->s, &idx);
+/*
+ * Copies the elements of an array from the index `start` up to but not
+ * including `end`, or the end of the array if that isn't given, into a
+ * new array.
+ */
 
-		struct value *str = new_value(v->loc);
-		str->s = kdgu_getchr(arr->s, idx);
-		str->type = VAL_STRING;
-		return str;
+struct value *
+builtin_slice(struct value *env,
+              location loc,
+              unsigned argc,
+              struct value **argv)
+{
+	struct value *arr = array_arg(loc, argv[0], "slice");
+	if (TYPE(arr) == VAL_ERROR) return arr;
+
+	for (unsigned i = 1; i < argc; i++) {
+		if (!IS_INT(argv[i]))
+			return error(arg_loc(loc, argv[i]),
+			             "builtin `slice' requires numeric"
+			             " bounds");
+		if (INT(argv[i]) < 0 || INT(argv[i]) > arr->num)
+			return index_error(loc, argv[i], arr);
 	}
 
-	return eval(env, v->car)->arr[i->i];
+	intptr_t start = INT(argv[1]), end = argc > 2 ? INT(argv[2]) : arr->num;
+
+	if (end < start)
+		return error(arg_loc(loc, argv[2]),
+		             "slice ends before it starts");
+
+	struct value *r = new_array(loc, end - start);
+	memcpy(r->arr, argv[0]->arr + start, (end - start) * sizeof *r->arr);
+
+	return r;
 }
 
+/*
+ * Checks that `h` is a hash table and, if `key` isn't NULL, that it can
+ * be used as a key.
+ */
+
+static struct value *
+hash_args(location loc, struct value *h, struct value *key, const char *name)
+{
+	if (TYPE(h) != VAL_HASH)
+		return error(arg_loc(loc, h),
+		             "builtin `%s' requires a hash table"
+		             " (this is %s %s)", name,
+		             IS_VOWEL(*TYPE_NAME(TYPE(h))) ? "an" : "a",
+		             TYPE_NAME(TYPE(h)));
+
+	if (key && !hashable(key))
+		return error(arg_loc(loc, key),
+		             "a key has to be an int, string or symbol"
+		             " (this is %s %s)",
+		             IS_VOWEL(*TYPE_NAME(TYPE(key))) ? "an" : "a",
+		             TYPE_NAME(TYPE(key)));
+
+	return h;
+}
+
+/*
+ * Makes a hash table holding each of the keys in its arguments with
+ * the value that follows it.
+ */
+
 struct value *
-builtin_length(struct value *env, struct value *v)
+builtin_make_hash(struct value *env,
+                  location loc,
+                  unsigned argc,
+                  struct value **argv)
 {
-	if (v->cdr->type != VAL_NIL)
-		return error(v->loc,
-		             "builtin `length' takes one argument");
+	if (argc % 2)
+		return error(loc, "builtin `make-hash' takes keys and"
+		             " values in pairs");
 
-	struct value *arr = eval(env, v->car);
+	struct value *h = new_hash(loc, argc / 2), *e;
 
-	if (arr->type == VAL_ARRAY) {
-		struct value *l = new_value(v->loc);
-		l->type = VAL_INT;
-		l->i = arr->num;
-		return l;
-	} else if (IS_LIST(arr)) {
-		return list_length(arr);
-	} else if (arr->type == VAL_STRING) {
-		struct value *l = new_value(v->loc);
-		l->type = VAL_INT;
-		l->i = kdgu_len(arr->s);
-		return l;
-	} else {
-		return error(v->loc,
-		             "builtin `length' takes a list, array,"
-		             " or string argument (this is %s %s)",
-		             IS_VOWEL(*TYPE_NAME(arr->type))
-		             ? "an" : "a",
-		             TYPE_NAME(arr->type));
+	for (unsigned i = 0; i < argc; i += 2) {
+		if (TYPE(e = hash_args(loc, h, argv[i], "make-hash"))
+		    == VAL_ERROR)
+			return e;
+		hash_put(h, argv[i], argv[i + 1]);
 	}
 
-	/* Unreachable. */
+	return h;
+}
+
+/*
+ * Returns the value of a key in a hash table, or the third argument
+ * (or nil) if it has none.
+ */
+
+struct value *
+builtin_gethash(struct value *env,
+                location loc,
+                unsigned argc,
+                struct value **argv)
+{
+	struct value *e = hash_args(loc, argv[0], argv[1], "gethash");
+	if (TYPE(e) == VAL_ERROR) return e;
+
+	struct value **p = hash_find(argv[0], argv[1]);
+	return p ? *p : argc > 2 ? argv[2] : Nil;
+}
+
+struct value *
+builtin_puthash(struct value *env,
+                location loc,
+                unsigned argc,
+                struct value **argv)
+{
+	struct value *e = hash_args(loc, argv[0], argv[1], "puthash");
+	if (TYPE(e) == VAL_ERROR) return e;
+
+	hash_put(argv[0], argv[1], argv[2]);
+	return argv[2];
+}
+
+/*
+ * Removes a key from a hash table. Returns whether it was there.
+ */
+
+struct value *
+builtin_remhash(struct value *env,
+                location loc,
+                unsigned argc,
+                struct value **argv)
+{
+	struct value *e = hash_args(loc, argv[0], argv[1], "remhash");
+	if (TYPE(e) == VAL_ERROR) return e;
+
+	return hash_remove(argv[0], argv[1]) ? True : Nil;
+}
+
+/*
+ * Returns a list of the keys in a hash table, in no particular order.
+ */
+
+struct value *
+builtin_hash_keys(struct value *env,
+                  location loc,
+                  unsigned argc,
+                  struct value **argv)
+{
+	struct value *h = hash_args(loc, argv[0], NULL, "hash-keys");
+	if (TYPE(h) == VAL_ERROR) return h;
+
+	struct value *r = Nil;
+	PROTECT(&h, &r);
+
+	for (unsigned i = 0; i < h->cap_slot; i++)
+		if (h->slots[i].key) r = cons(h->slots[i].key, r);
+
+	return r;
+}
+
+/*
+ * Calls a function with each key in a hash table and its value, in no
+ * particular order. Keys that are added while it's going might not be
+ * seen, and if the table grows some might be seen twice.
+ */
+
+struct value *
+builtin_maphash(struct value *env,
+                location loc,
+                unsigned argc,
+                struct value **argv)
+{
+	struct value *fn = argv[0], *h = argv[1], *arg[2] = { 0 }, *r;
+	if (TYPE(h = hash_args(loc, h, NULL, "maphash")) == VAL_ERROR)
+		return h;
+
+	PROTECT(&env, &fn, &h);
+	PROTECT_N(arg, 2);
+
+	for (unsigned i = 0; i < h->cap_slot; i++) {
+		if (!h->slots[i].key) continue;
+		arg[0] = h->slots[i].key;
+		arg[1] = h->slots[i].val;
+		r = invoke(env, loc, fn, 2, arg);
+		if (TYPE(r) == VAL_ERROR) return r;
+	}
 
 	return Nil;
 }
 
+/*
+ * Gets the argument `v` of the builtin `name` as a sequence; lists and
+ * arrays are taken as sequences of their elements.
+ */
+
+static struct value *
+seq_arg(location loc, struct value *v, const char *name)
+{
+	struct value *seq = as_seq(loc, v);
+	if (seq) return seq;
+	return error(arg_loc(loc, v),
+	             "builtin `%s' requires a sequence, list, or array"
+	             " (this is %s %s)", name,
+	             IS_VOWEL(*TYPE_NAME(TYPE(v))) ? "an" : "a",
+	             TYPE_NAME(TYPE(v)));
+}
+
+/*
+ * Makes the sequence of integers from `start` (or 0) up to but not
+ * including `end`, counting by `step` (or 1). With no arguments at
+ * all it goes on for ever.
+ */
+
+struct value *
+builtin_range(struct value *env,
+              location loc,
+              unsigned argc,
+              struct value **argv)
+{
+	for (unsigned i = 0; i < argc; i++)
+		if (!IS_INT(argv[i]))
+			return error(arg_loc(loc, argv[i]),
+			             "builtin `range' requires numeric"
+			             " arguments");
+
+	struct value *start = argc > 1 ? argv[0] : MAKE_INT(0);
+	struct value *end = argc == 1 ? argv[0] : argc ? argv[1] : Nil;
+	struct value *step = argc > 2 ? argv[2] : MAKE_INT(1);
+
+	if (!INT(step))
+		return error(arg_loc(loc, argv[2]), "a range can't count"
+		             " by zero");
+
+	return new_seq(loc, SEQ_RANGE, start, end, step);
+}
+
+/*
+ * Makes the sequence of a function applied to each element of a
+ * sequence.
+ */
+
 struct value *
-builtin_s(struct value *env, struct value *v)
+builtin_map(struct value *env,
+            location loc,
+            unsigned argc,
+            struct value **argv)
 {
-	struct value *pattern = eval(env, v->car);
-	struct value *replace = eval(env, v->cdr->car);
-	struct value *options = eval(env, v->cdr->cdr->car);
-	struct value *subject = eval(env, v->cdr->cdr->cdr->car);
+	struct value *seq = seq_arg(loc, argv[1], "map");
+	if (TYPE(seq) == VAL_ERROR) return seq;
+	return new_seq(loc, SEQ_MAP, seq, argv[0], Nil);
+}
 
-	int opt = 0;
+/*
+ * Makes the sequence of the elements of a sequence that a function
+ * returns t for.
+ */
 
-	for (unsigned i = 0; i < options->s->len; i++) {
-		switch (options->s->s[i]) {
-		case 'g': opt |= KTRE_GLOBAL; break;
-		case 'i': opt |= KTRE_INSENSITIVE; break;
-		default: return error(v->loc,
-		                      "unrecognized mode modifier");
-		}
+struct value *
+builtin_filter(struct value *env,
+               location loc,
+               unsigned argc,
+               struct value **argv)
+{
+	struct value *seq = seq_arg(loc, argv[1], "filter");
+	if (TYPE(seq) == VAL_ERROR) return seq;
+	return new_seq(loc, SEQ_FILTER, seq, argv[0], Nil);
+}
+
+/*
+ * Makes the sequence of the first however many elements of a
+ * sequence.
+ */
+
+struct value *
+builtin_take(struct value *env,
+             location loc,
+             unsigned argc,
+             struct value **argv)
+{
+	if (!IS_INT(argv[0]))
+		return error(loc,
+		             "builtin `take' requires a numeric first"
+		             " argument");
+
+	struct value *seq = seq_arg(loc, argv[1], "take");
+	if (TYPE(seq) == VAL_ERROR) return seq;
+	return new_seq(loc, SEQ_TAKE, seq, Nil, argv[0]);
+}
+
+/*
+ * Combines the elements of a sequence with a function, starting from
+ * the initial value: `(reduce f x s)` is `(f (f x s0) s1)` and so on.
+ */
+
+struct value *
+builtin_reduce(struct value *env,
+               location loc,
+               unsigned argc,
+               struct value **argv)
+{
+	struct value *it = seq_arg(loc, argv[2], "reduce");
+	struct value *fn = argv[0], *arg[2] = { argv[1], NULL }, *v;
+	if (TYPE(it) == VAL_ERROR) return it;
+
+	PROTECT(&env, &it, &fn);
+	PROTECT_N(arg, 2);
+	it = seq_start(it);
+
+	while ((v = seq_next(env, loc, it))) {
+		if (TYPE(v) == VAL_ERROR) return v;
+		arg[1] = v;
+		arg[0] = invoke(env, loc, fn, 2, arg);
+		if (TYPE(arg[0]) == VAL_ERROR) return arg[0];
 	}
 
-	kdgu *res = ktre_replace(subject->s, pattern->s, replace->s, &KDGU("$"), opt);
+	return arg[0];
+}
+
+/*
+ * Returns the elements of a sequence as a list.
+ */
+
+struct value *
+builtin_collect(struct value *env,
+                location loc,
+                unsigned argc,
+                struct value **argv)
+{
+	struct value *it = seq_arg(loc, argv[0], "collect");
+	if (TYPE(it) == VAL_ERROR) return it;
+
+	struct value *head = Nil, *tail = Nil, *v = NULL;
+	PROTECT(&env, &it, &head, &tail, &v);
+	it = seq_start(it);
+
+	while ((v = seq_next(env, loc, it))) {
+		if (TYPE(v) == VAL_ERROR) return v;
+		v = cons(v, Nil);
+		if (tail == Nil) head = v;
+		else tail->cdr = v;
+		tail = v;
+	}
+
+	return head;
+}
+
+/*
+ * Checks that the argument `v` of the builtin `name` is a string or a
+ * rope.
+ */
+
+static struct value *
+text_arg(location loc, struct value *v, const char *name)
+{
+	if (IS_TEXT(v)) return v;
+	return error(arg_loc(loc, v),
+	             "builtin `%s' requires a string argument"
+	             " (this is %s %s)", name,
+	             IS_VOWEL(*TYPE_NAME(TYPE(v))) ? "an" : "a",
+	             TYPE_NAME(TYPE(v)));
+}
 
-	struct value *str = new_value(v->loc);
-	str->type = VAL_STRING;
-	str->s = res;
+/*
+ * Like `text_arg()`, for builtins that need all of the text in one
+ * string: a rope in `*v` is replaced with its string.
+ */
 
+static struct value *
+string_arg(location loc, struct value **v, const char *name)
+{
+	struct value *e = text_arg(loc, *v, name);
+	if (TYPE(e) == VAL_ERROR) return e;
+	return *v = rope_flatten(*v);
+}
+
+static struct value *
+make_string(location loc, kdgu *s)
+{
+	struct value *str = new_value(VAL_STRING, loc);
+	str->s = s;
 	return str;
 }
 
+struct value *
+builtin_char_at(struct value *env,
+                location loc,
+                unsigned argc,
+                struct value **argv)
+{
+	struct value *str = text_arg(loc, argv[0], "char-at");
+	if (TYPE(str) == VAL_ERROR) return str;
+
+	if (!IS_INT(argv[1]))
+		return error(loc,
+		             "builtin `char-at' requires a numeric second"
+		             " argument");
+
+	return char_at(loc, str, argv[1]);
+}
+
+/*
+ * Returns the characters of a string or rope from the index `start` up
+ * to but not including `end`, or the end if that isn't given.
+ */
+
+struct value *
+builtin_substring(struct value *env,
+                  location loc,
+                  unsigned argc,
+                  struct value **argv)
+{
+	struct value *str = text_arg(loc, argv[0], "substring");
+	if (TYPE(str) == VAL_ERROR) return str;
+
+	for (unsigned i = 1; i < argc; i++) {
+		if (!IS_INT(argv[i]))
+			return error(arg_loc(loc, argv[i]),
+			             "builtin `substring' requires numeric"
+			             " bounds");
+		if (INT(argv[i]) < 0 || INT(argv[i]) > text_length(str))
+			return index_error(loc, argv[i], str);
+	}
+
+	intptr_t start = INT(argv[1]);
+	intptr_t end = argc > 2 ? INT(argv[2]) : text_length(str);
+
+	if (end < start)
+		return error(arg_loc(loc, argv[2]),
+		             "substring ends before it starts");
+
+	return rope_substring(str, start, end);
+}
+
+/*
+ * Joins strings and ropes together, without copying any of them.
+ */
+
+struct value *
+builtin_concat(struct value *env,
+               location loc,
+               unsigned argc,
+               struct value **argv)
+{
+	struct value *r = NULL, *e;
+	PROTECT(&r);
+	r = make_string(loc, kdgu_new(KDGU_FMT_UTF8, "", 0));
+
+	for (unsigned i = 0; i < argc; i++) {
+		if (TYPE(e = text_arg(loc, argv[i], "concat")) == VAL_ERROR)
+			return e;
+		r = rope_concat(r, argv[i]);
+	}
+
+	return r;
+}
+
+/*
+ * Returns `v` as it would be printed, as a string.
+ */
+
+static struct value *
+printed(location loc, struct value *v)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *f = open_memstream(&buf, &size);
+
+	struct value *e = print_value(f, v);
+	fclose(f);
+
+	if (TYPE(e) == VAL_ERROR) {
+		free(buf);
+		return e;
+	}
+
+	kdgu *s = kdgu_new(KDGU_FMT_UTF8, buf, size);
+	free(buf);
+
+	return make_string(loc, s);
+}
+
+/*
+ * Makes a rope from a template, in which `~a` stands for the next of
+ * the other arguments and `~~` for a tilde. Strings and ropes go in
+ * as they are, without being copied, and anything else as it would
+ * be printed.
+ */
+
+struct value *
+builtin_format(struct value *env,
+               location loc,
+               unsigned argc,
+               struct value **argv)
+{
+	struct value *r = string_arg(loc, &argv[0], "format"), *piece = NULL;
+	if (TYPE(r) == VAL_ERROR) return r;
+
+	kdgu *f = argv[0]->s;
+	unsigned next = 1, start = 0;
+	PROTECT(&r, &piece);
+	r = make_string(loc, kdgu_new(f->fmt, "", 0));
+
+	for (unsigned i = 0; i <= f->len; i++) {
+		if (i < f->len && f->s[i] != '~') continue;
+
+		if (i > start) {
+			piece = make_string(loc, kdgu_new(f->fmt, f->s + start,
+			                                  i - start));
+			r = rope_concat(r, piece);
+		}
+
+		if (i == f->len) break;
+
+		/* The second tilde starts the next piece. */
+
+		if (i + 1 < f->len && f->s[i + 1] == '~') {
+			start = ++i;
+			continue;
+		}
+
+		if (i + 1 == f->len || f->s[i + 1] != 'a')
+			return error(argv[0]->loc, "unknown format directive"
+			             " `%.*s'", i + 1 < f->len ? 2 : 1,
+			             f->s + i);
+
+		if (next == argc)
+			return error(loc, "not enough arguments for the"
+			             " format");
+
+		piece = argv[next++];
+		if (!IS_TEXT(piece)) piece = printed(loc, piece);
+		if (TYPE(piece) == VAL_ERROR) return piece;
+
+		r = rope_concat(r, piece);
+		start = ++i + 1;
+	}
+
+	if (next < argc)
+		return error(arg_loc(loc, argv[next]),
+		             "too many arguments for the format");
+
+	return r;
+}
+
+/*
+ * Gets the compiled program for the pattern argument `*p` of the
+ * builtin `name`, which is either a regex or a string to be compiled
+ * with the mode modifiers in `*o` (if `o` isn't NULL). A regex
+ * comes with modifiers of its own. Returns NULL and sets `*err` if
+ * there's something wrong with it.
+ */
+
+static ktre *
+regex_arg(location loc,
+          struct value **p,
+          struct value **o,
+          const char *name,
+          struct value **err)
+{
+	if (o && TYPE(*err = string_arg(loc, o, name)) == VAL_ERROR)
+		return NULL;
+
+	if (TYPE(*p) == VAL_ROPE) *p = rope_flatten(*p);
+	struct value *pattern = *p, *options = o ? *o : NULL;
+
+	if (TYPE(pattern) == VAL_REGEX) {
+		if (!options || !options->s->len) return pattern->re;
+		*err = error(options->loc, "a compiled regex can't be"
+		             " given mode modifiers");
+		return NULL;
+	}
+
+	if (TYPE(pattern) != VAL_STRING) {
+		*err = error(arg_loc(loc, pattern),
+		             "builtin `%s' requires a regex or string"
+		             " pattern (this is %s %s)", name,
+		             IS_VOWEL(*TYPE_NAME(TYPE(pattern)))
+		             ? "an" : "a",
+		             TYPE_NAME(TYPE(pattern)));
+		return NULL;
+	}
+
+	int opt = options ? regex_options(options->s) : 0;
+
+	if (opt < 0) {
+		*err = error(options->loc, "unrecognized mode modifier");
+		return NULL;
+	}
+
+	ktre *re = cached_regex(pattern->s, opt);
+
+	if (!re || re->err) {
+		*err = error(pattern->loc, "couldn't compile regex: %s",
+		             re ? re->err_str : "out of memory");
+		return NULL;
+	}
+
+	return re;
+}
+
+/*
+ * Compiles a regex once, to be used in place of a pattern string.
+ */
+
+struct value *
+builtin_regex(struct value *env,
+              location loc,
+              unsigned argc,
+              struct value **argv)
+{
+	struct value *e = string_arg(loc, &argv[0], "regex");
+	if (TYPE(e) == VAL_ERROR) return e;
+	if (argc > 1
+	    && TYPE(e = string_arg(loc, &argv[1], "regex")) == VAL_ERROR)
+		return e;
+
+	struct value *pattern = argv[0], *options = argc > 1 ? argv[1] : NULL;
+
+	int opt = options ? regex_options(options->s) : 0;
+	if (opt < 0) return error(options->loc, "unrecognized mode modifier");
+
+	ktre *re = ktre_compile(pattern->s, opt);
+
+	if (!re || re->err) {
+		e = error(pattern->loc, "couldn't compile regex: %s",
+		          re ? re->err_str : "out of memory");
+		if (re) ktre_free(re);
+		return e;
+	}
+
+	kdgu *copy = kdgu_copy(pattern->s);
+	struct value *r = new_value(VAL_REGEX, loc);
+	r->pattern = copy;
+	r->re = re;
+	r->opt = opt;
+
+	return r;
+}
+
+struct value *
+builtin_s(struct value *env,
+          location loc,
+          unsigned argc,
+          struct value **argv)
+{
+	struct value *e = NULL;
+
+	if (TYPE(e = string_arg(loc, &argv[1], "s")) == VAL_ERROR
+	    || TYPE(e = string_arg(loc, &argv[3], "s")) == VAL_ERROR)
+		return e;
+
+	ktre *re = regex_arg(loc, &argv[0], &argv[2], "s", &e);
+	if (!re) return e;
+
+	return make_string(loc, ktre_filter(re, argv[3]->s, argv[1]->s,
+	                                    &KDGU("$")));
+}
+
+/*
+ * Returns the groups of the `i`th match, with the whole match first,
+ * as a list of strings; a group that didn't take part is nil.
+ */
+
+static struct value *
+match_groups(location loc, ktre *re, int **vec, int i,
+             struct value *subject)
+{
+	struct value *r = Nil, *str = NULL;
+	PROTECT(&subject, &r, &str);
+
+	for (int j = re->num_groups; j; j--) {
+		int start = vec[i][2 * (j - 1)], len = vec[i][2 * (j - 1) + 1];
+
+		str = start < 0 ? Nil
+			: make_string(loc, kdgu_new(subject->s->fmt,
+			                            subject->s->s + start,
+			                            len));
+		r = cons(str, r);
+	}
+
+	return r;
+}
+
+/*
+ * Matches a pattern against a string. Returns the groups of the first
+ * match, or with the `g` modifier a list of the groups of every
+ * match, or nil if it doesn't match.
+ */
+
+struct value *
+builtin_match(struct value *env,
+              location loc,
+              unsigned argc,
+              struct value **argv)
+{
+	struct value *e = NULL;
+	if (TYPE(e = string_arg(loc, &argv[1], "match")) == VAL_ERROR)
+		return e;
+
+	ktre *re = regex_arg(loc, &argv[0], argc > 2 ? &argv[2] : NULL,
+	                     "match", &e);
+	if (!re) return e;
+
+	struct value *subject = argv[1];
+
+	int **vec = NULL;
+	if (!ktre_exec(re, subject->s, &vec)) return Nil;
+
+	/*
+	 * Nothing else can use `re` while the groups are made, so
+	 * `vec` stays good.
+	 */
+
+	if (!(re->opt & KTRE_GLOBAL))
+		return match_groups(loc, re, vec, 0, subject);
+
+	struct value *r = Nil, *g = NULL;
+	PROTECT(&subject, &r, &g);
+
+	for (int i = re->num_matches; i; i--) {
+		g = match_groups(loc, re, vec, i - 1, subject);
+		r = cons(g, r);
+	}
+
+	return r;
+}
+
+/*
+ * Splits a string into a list of the pieces between the matches of a
+ * pattern.
+ */
+
+struct value *
+builtin_split(struct value *env,
+              location loc,
+              unsigned argc,
+              struct value **argv)
+{
+	struct value *e = NULL;
+	if (TYPE(e = string_arg(loc, &argv[1], "split")) == VAL_ERROR)
+		return e;
+
+	ktre *re = regex_arg(loc, &argv[0], argc > 2 ? &argv[2] : NULL,
+	                     "split", &e);
+	if (!re) return e;
+
+	int num = 0;
+	kdgu **piece = ktre_split(re, argv[1]->s, &num);
+	struct value *r = Nil, *str = NULL;
+	PROTECT(&r, &str);
+
+	for (int i = num; i; i--) {
+		str = make_string(loc, piece[i - 1]);
+		r = cons(str, r);
+	}
+
+	free(piece);
+
+	return r;
+}
+
 void
 load_builtins(struct value *env)
 {
-	add_builtin(env, "println", builtin_println);
-	add_builtin(env, "length",  builtin_length);
-	add_builtin(env, "print",   builtin_print);
+	PROTECT(&env);
+
 	add_builtin(env, "progn",   builtin_progn);
 	add_builtin(env, "macro",   builtin_macro);
 	add_builtin(env, "while",   builtin_while);
 	add_builtin(env, "quote",   builtin_quote);
-	add_builtin(env, "list",    builtin_list);
-	add_builtin(env, "cons",    builtin_cons);
 	add_builtin(env, "setq",    builtin_setq);
-	add_builtin(env, "nth",     builtin_nth);
 	add_builtin(env, "set",     builtin_set);
-	add_builtin(env, "car",     builtin_car);
-	add_builtin(env, "cdr",     builtin_cdr);
 	add_builtin(env, "fn",      builtin_fn);
 	add_builtin(env, "if",      builtin_if);
-	add_builtin(env, "+",       builtin_add);
-	add_builtin(env, "-",       builtin_sub);
-	add_builtin(env, "*",       builtin_mul);
-	add_builtin(env, "/",       builtin_div);
-	add_builtin(env, "=",       builtin_eq);
-	add_builtin(env, "<",       builtin_less);
-	add_builtin(env, "s",       builtin_s);
+
+	add_native(env, "println", builtin_println, 0, -1);
+	add_native(env, "length",  builtin_length,  1,  1);
+	add_native(env, "print",   builtin_print,   0, -1);
+	add_native(env, "list",    builtin_list,    0, -1);
+	add_native(env, "cons",    builtin_cons,    2,  2);
+	add_native(env, "nth",     builtin_nth,     2,  2);
+	add_native(env, "array",   builtin_array,   0, -1);
+	add_native(env, "push",    builtin_push,    2,  2);
+	add_native(env, "pop",     builtin_pop,     1,  1);
+	add_native(env, "aset",    builtin_aset,    3,  3);
+	add_native(env, "slice",   builtin_slice,   2,  3);
+	add_native(env, "char-at", builtin_char_at, 2,  2);
+	add_native(env, "substring", builtin_substring, 2, 3);
+	add_native(env, "concat",  builtin_concat,  0, -1);
+	add_native(env, "format",  builtin_format,  1, -1);
+	add_native(env, "range",   builtin_range,   0,  3);
+	add_native(env, "map",     builtin_map,     2,  2);
+	add_native(env, "filter",  builtin_filter,  2,  2);
+	add_native(env, "take",    builtin_take,    2,  2);
+	add_native(env, "reduce",  builtin_reduce,  3,  3);
+	add_native(env, "collect", builtin_collect, 1,  1);
+	add_native(env, "make-hash", builtin_make_hash, 0, -1);
+	add_native(env, "gethash", builtin_gethash, 2,  3);
+	add_native(env, "puthash", builtin_puthash, 3,  3);
+	add_native(env, "remhash", builtin_remhash, 2,  2);
+	add_native(env, "hash-keys", builtin_hash_keys, 1, 1);
+	add_native(env, "maphash", builtin_maphash, 2,  2);
+	add_native(env, "car",     builtin_car,     1,  1);
+	add_native(env, "cdr",     builtin_cdr,     1,  1);
+	add_native(env, "+",       builtin_add,     0, -1);
+	add_native(env, "-",       builtin_sub,     0, -1);
+	add_native(env, "*",       builtin_mul,     0, -1);
+	add_native(env, "/",       builtin_div,     0, -1);
+	add_native(env, "=",       builtin_eq,      0, -1);
+	add_native(env, "<",       builtin_less,    0, -1);
+	add_native(env, "s",       builtin_s,       4,  4);
+	add_native(env, "regex",   builtin_regex,   1,  2);
+	add_native(env, "match",   builtin_match,   2,  3);
+	add_native(env, "split",   builtin_split,   2,  3);
 }
@@ -3,6 +3,9 @@
 
 #include "lisp.h"
 
+builtin builtin_quote, builtin_fn, builtin_macro, builtin_if,
+	builtin_while, builtin_progn, builtin_setq;
+
 void load_builtins(struct value *env);
 
 #endif
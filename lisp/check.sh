@@ -0,0 +1,126 @@
+#!/bin/sh
+#
+# Runs test.tek with the tree walker and with the VM and checks that
+# they print exactly the same thing, errors included. Then checks that
+# `--cache` doesn't replay a form whose values were changed in place,
+# and that an image gives back what was dumped into it.
+#
+# usage: check.sh [TEK]
+#
+#   TEK   the interpreter to run ($TEK, or tek from the PATH)
+
+tek=${1:-${TEK:-tek}}
+dir=$(dirname "$0")
+tmp=${TMPDIR:-/tmp}/tek-check.$$
+trap 'rm -f "$tmp".walk "$tmp".vm "$tmp".tek "$tmp".new "$tmp".img \
+            "$tmp".lib "$tmp".bad' EXIT
+
+(cd "$dir" && "$tek" test.tek) > "$tmp".walk 2>&1
+(cd "$dir" && "$tek" --vm test.tek) > "$tmp".vm 2>&1
+
+if ! diff -u "$tmp".walk "$tmp".vm; then
+	echo "check.sh: the tree walker and the VM disagree" >&2
+	exit 1
+fi
+
+grep -q "That's all, folks!" "$tmp".walk || {
+	echo "check.sh: test.tek didn't run to the end" >&2
+	exit 1
+}
+
+# The second run has to see the 4 pushed onto the array, and the closure
+# counting up from where the edited form left it.
+
+for mode in "" --vm; do
+	rm -f "$tmp".img
+
+	cat > "$tmp".tek <<-EOF
+	(setq v (array))
+	(push v 3)
+	(println v)
+	(fn make-counter (n) (fn () (setq n (+ n 1))))
+	(setq counter (make-counter 0))
+	(counter)
+	(println (counter))
+	EOF
+
+	"$tek" $mode --cache "$tmp".img "$tmp".tek > /dev/null 2>&1
+	sed 's/(push v 3)/(push v 4)/; s/^(counter)$/(progn (counter) (counter))/' \
+	    "$tmp".tek > "$tmp".new
+	out=$("$tek" $mode --cache "$tmp".img "$tmp".new 2>&1)
+
+	if [ "$out" != "$(printf '4\n3')" ]; then
+		echo "check.sh: --cache${mode:+ with $mode} replayed stale output:" >&2
+		echo "$out" >&2
+		exit 1
+	fi
+done
+
+# What's dumped into an image has to do the same when it's loaded as it
+# does straight from the source, and an error in a function from the
+# image still has to be blamed on the file it was written in. An image
+# that's been cut short or scribbled on has to be turned away.
+
+cat > "$tmp".lib <<'EOF'
+(fn add1 (x) (+ x 1))
+(fn make-counter (n) (fn () (setq n (+ n 1))))
+(setq counter (make-counter 10))
+(macro twice (x) (list 'list x x))
+(setq table (make-hash 'one 1 "two" 2 3 'three))
+(setq text (concat (concat "a rope " "made of ") "pieces"))
+(setq odds (filter (fn (x) (= (- x (* (/ x 2) 2)) 1)) (range)))
+(setq word (regex "\w+" "g"))
+(fn broken (x)
+  (car x))
+EOF
+
+cat > "$tmp".tek <<'EOF'
+(println (add1 1) (counter) (counter))
+(println (twice 5))
+(println (gethash table 'one) (gethash table "two") (gethash table 3))
+(println text (length text))
+(println (collect (take 3 odds)))
+(println (s word "<$0>" "" "two words"))
+EOF
+
+for mode in "" --vm; do
+	rm -f "$tmp".img
+
+	if ! "$tek" $mode --dump "$tmp".img "$tmp".lib > /dev/null 2>&1; then
+		echo "check.sh: --dump${mode:+ with $mode} failed" >&2
+		exit 1
+	fi
+
+	cat "$tmp".lib "$tmp".tek > "$tmp".new
+	"$tek" $mode "$tmp".new > "$tmp".walk 2>&1
+	"$tek" $mode --image "$tmp".img "$tmp".tek > "$tmp".vm 2>&1
+
+	if ! diff -u "$tmp".walk "$tmp".vm; then
+		echo "check.sh: the image${mode:+ with $mode} doesn't" \
+		     "do what its source did" >&2
+		exit 1
+	fi
+
+	echo '(broken 1)' > "$tmp".new
+	"$tek" $mode --image "$tmp".img "$tmp".new > "$tmp".walk 2>&1
+
+	grep -q "^error: $tmp.lib:10:3: " "$tmp".walk || {
+		echo "check.sh: an error from the image${mode:+ with $mode}" \
+		     "is in the wrong place:" >&2
+		cat "$tmp".walk >&2
+		exit 1
+	}
+
+	size=$(wc -c < "$tmp".img)
+	head -c $((size / 2)) "$tmp".img > "$tmp".bad
+	{ printf 'X'; tail -c +2 "$tmp".img; } > "$tmp".new
+
+	for bad in "$tmp".bad "$tmp".new; do
+		if "$tek" $mode --image "$bad" "$tmp".tek > /dev/null 2>&1
+		then
+			echo "check.sh: a broken image${mode:+ with $mode}" \
+			     "was loaded" >&2
+			exit 1
+		fi
+	done
+done
@@ -0,0 +1,346 @@
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "gc.h"
+#include "vm.h"
+#include "lisp.h"
+#include "builtin.h"
+
+/*
+ * The compiler. It turns a list of forms into code for the VM in
+ * vm.c. Local variables have already been turned into `VAL_LOCAL`
+ * references by the resolver and compile straight to slot accesses;
+ * anything else that's a symbol is looked up when it's executed.
+ *
+ * The special forms `quote', `if', `while', `progn' and `setq' are
+ * compiled inline when the head of a form names the builtin at
+ * compile time, and macros are expanded at compile time. Functions
+ * are compiled the first time they're called, so a macro only has to
+ * be defined before then; they're compiled again if a macro changes
+ * after they've used it. Forms that the compiler doesn't understand
+ * (like `fn' and `macro', and calls to things that don't exist yet)
+ * are compiled into an instruction that hands them to `eval()'.
+ */
+
+/*
+ * Code that's still being compiled isn't owned by anything yet, so
+ * its constants are kept alive from here.
+ */
+
+static struct code *compiling;
+
+static void
+walk_compiling(gc_visitor *visit)
+{
+	for (struct code *c = compiling; c; c = c->next)
+		trace_code(c, visit);
+}
+
+void
+trace_code(struct code *c, gc_visitor *visit)
+{
+	for (unsigned i = 0; i < c->num_k; i++)
+		visit(&c->k[i]);
+}
+
+void
+free_code(struct code *c)
+{
+	if (!c) return;
+	free(c->op);
+	free(c->loc);
+	free(c->k);
+	free(c);
+}
+
+static unsigned
+emit(struct code *c, location loc, int op)
+{
+	if (c->num_op == c->cap_op) {
+		c->cap_op = c->cap_op ? c->cap_op * 2 : 32;
+		c->op = realloc(c->op, c->cap_op * sizeof *c->op);
+		c->loc = realloc(c->loc, c->cap_op * sizeof *c->loc);
+	}
+
+	c->op[c->num_op] = op;
+	c->loc[c->num_op] = loc;
+
+	return c->num_op++;
+}
+
+static int
+constant(struct code *c, struct value *v)
+{
+	for (unsigned i = 0; i < c->num_k; i++)
+		if (c->k[i] == v) return i;
+
+	if (c->num_k == c->cap_k) {
+		c->cap_k = c->cap_k ? c->cap_k * 2 : 8;
+		c->k = realloc(c->k, c->cap_k * sizeof *c->k);
+	}
+
+	c->k[c->num_k] = v;
+
+	return c->num_k++;
+}
+
+static void
+emit_const(struct code *c, location loc, struct value *v)
+{
+	emit(c, loc, OP_CONST);
+	emit(c, loc, constant(c, v));
+}
+
+static void
+emit_eval(struct code *c, struct value *v)
+{
+	emit(c, v->loc, OP_EVAL);
+	emit(c, v->loc, constant(c, v));
+}
+
+static unsigned
+list_count(struct value *list)
+{
+	unsigned n = 0;
+	for (; TYPE(list) == VAL_CELL; list = list->cdr) n++;
+	return TYPE(list) == VAL_NIL ? n : -1u;
+}
+
+static void compile_expr(struct code *c,
+                         struct value *env,
+                         struct value *v,
+                         location loc,
+                         bool tail);
+
+/*
+ * Compiles the forms in `list` like `progn' would evaluate them,
+ * leaving the value of the last one on the stack.
+ */
+
+static void
+compile_body(struct code *c,
+             struct value *env,
+             struct value *list,
+             location loc,
+             bool tail)
+{
+	PROTECT(&env, &list);
+
+	if (TYPE(list) != VAL_CELL) {
+		emit_const(c, loc, Nil);
+		return;
+	}
+
+	for (; TYPE(list) == VAL_CELL; list = list->cdr) {
+		bool last = TYPE(list->cdr) != VAL_CELL;
+		compile_expr(c, env, list->car, list->loc, tail && last);
+		if (!last) emit(c, list->loc, OP_POP);
+	}
+}
+
+static void
+compile_if(struct code *c,
+           struct value *env,
+           struct value *v,
+           bool tail)
+{
+	PROTECT(&env, &v);
+	struct value *args = v->cdr;
+
+	compile_expr(c, env, args->car, args->loc, false);
+	emit(c, v->loc, OP_JUMPF);
+	unsigned jf = emit(c, v->loc, 0);
+
+	args = v->cdr->cdr;
+	compile_expr(c, env, args->car, args->loc, tail);
+	emit(c, v->loc, OP_JUMP);
+	unsigned j = emit(c, v->loc, 0);
+
+	c->op[jf] = c->num_op;
+	compile_body(c, env, v->cdr->cdr->cdr, v->loc, tail);
+	c->op[j] = c->num_op;
+}
+
+/*
+ * The result of the last iteration stays on the stack under the
+ * condition, starting out as nil.
+ */
+
+static void
+compile_while(struct code *c, struct value *env, struct value *v)
+{
+	PROTECT(&env, &v);
+
+	emit_const(c, v->loc, Nil);
+	unsigned top = c->num_op;
+	compile_expr(c, env, v->cdr->car, v->cdr->loc, false);
+	emit(c, v->loc, OP_JUMPF);
+	unsigned jf = emit(c, v->loc, 0);
+	emit(c, v->loc, OP_POP);
+	compile_body(c, env, v->cdr->cdr, v->loc, false);
+	emit(c, v->loc, OP_JUMP);
+	emit(c, v->loc, top);
+	c->op[jf] = c->num_op;
+}
+
+static void
+compile_setq(struct code *c, struct value *env, struct value *v)
+{
+	PROTECT(&env, &v);
+	struct value *args = v->cdr;
+
+	compile_expr(c, env, args->cdr->car, args->cdr->loc, false);
+
+	args = v->cdr;
+	if (TYPE(args->car) == VAL_LOCAL) {
+		emit(c, v->loc, OP_SETLOCAL);
+		emit(c, v->loc, args->car->depth);
+		emit(c, v->loc, args->car->index);
+		return;
+	}
+
+	emit(c, v->loc, OP_SETGLOBAL);
+	emit(c, args->loc, constant(c, args->car));
+}
+
+static void
+compile_call(struct code *c,
+             struct value *env,
+             struct value *v,
+             bool tail)
+{
+	unsigned n = 0;
+	PROTECT(&env, &v);
+
+	compile_expr(c, env, v->car, v->loc, false);
+
+	for (struct value *p = v->cdr; TYPE(p) == VAL_CELL; p = p->cdr, n++) {
+		PROTECT(&p);
+		compile_expr(c, env, p->car, p->loc, false);
+	}
+
+	emit(c, v->loc, tail ? OP_TAILCALL : OP_CALL);
+	emit(c, v->loc, n);
+}
+
+static void
+compile_form(struct code *c,
+             struct value *env,
+             struct value *v,
+             bool tail)
+{
+	if (list_count(v) == -1u) {
+		emit_eval(c, v);
+		return;
+	}
+
+	if (TYPE(v->car) != VAL_SYMBOL) {
+		compile_call(c, env, v, tail);
+		return;
+	}
+
+	struct value **bind = find(env, v->car);
+
+	if (!bind) {
+		emit_eval(c, v);
+		return;
+	}
+
+	struct value *head = *bind;
+	unsigned n = list_count(v) - 1;
+
+	if (TYPE(head) == VAL_MACRO) {
+		PROTECT(&env, &v);
+		struct value *e = expand(env, v);
+		c->expanded = true;
+		if (TYPE(e) == VAL_ERROR) emit_eval(c, v);
+		else compile_expr(c, env, e, v->loc, tail);
+		return;
+	}
+
+	if (TYPE(head) != VAL_BUILTIN) {
+		compile_call(c, env, v, tail);
+		return;
+	}
+
+	if (head->prim == builtin_quote && n == 1)
+		emit_const(c, v->loc, v->cdr->car);
+	else if (head->prim == builtin_if && n >= 2)
+		compile_if(c, env, v, tail);
+	else if (head->prim == builtin_while && n >= 1)
+		compile_while(c, env, v);
+	else if (head->prim == builtin_progn)
+		compile_body(c, env, v->cdr, v->loc, tail);
+	else if (head->prim == builtin_setq && n == 2
+	         && (TYPE(v->cdr->car) == VAL_SYMBOL
+	             || TYPE(v->cdr->car) == VAL_LOCAL))
+		compile_setq(c, env, v);
+	else if (head->prim == builtin_quote
+	         || head->prim == builtin_if
+	         || head->prim == builtin_while
+	         || head->prim == builtin_setq
+	         || head->prim == builtin_fn
+	         || head->prim == builtin_macro)
+		emit_eval(c, v);
+	else
+		compile_call(c, env, v, tail);
+}
+
+static void
+compile_expr(struct code *c,
+             struct value *env,
+             struct value *v,
+             location loc,
+             bool tail)
+{
+	switch (TYPE(v)) {
+	case VAL_SYMBOL:
+		emit(c, loc, OP_GLOBAL);
+		emit(c, loc, constant(c, v));
+		break;
+	case VAL_LOCAL:
+		emit(c, loc, OP_LOCAL);
+		emit(c, loc, v->depth);
+		emit(c, loc, v->index);
+		break;
+	case VAL_CELL:
+		compile_form(c, env, v, tail);
+		break;
+	case VAL_INT:     case VAL_STRING:
+	case VAL_BUILTIN: case VAL_FUNCTION:
+	case VAL_ARRAY:   case VAL_TRUE:
+	case VAL_NIL:     case VAL_REGEX:
+	case VAL_HASH:    case VAL_ROPE:
+	case VAL_SEQ:
+		emit_const(c, loc, v);
+		break;
+	default:
+		emit_eval(c, v);
+	}
+}
+
+/*
+ * Compiles the list of forms `body` as the body of a function that
+ * was defined in `env`, or as top-level code if `env` is the global
+ * environment. `loc` is used for the implicit nil of an empty body.
+ */
+
+struct code *
+compile(struct value *env, struct value *body, location loc)
+{
+	static bool rooted = false;
+	if (!rooted) gc_roots(walk_compiling), rooted = true;
+
+	struct code *c = calloc(1, sizeof *c);
+	c->epoch = macro_epoch;
+	c->next = compiling;
+	compiling = c;
+
+	compile_body(c, env, body, loc, true);
+	emit(c, loc, OP_RETURN);
+
+	compiling = c->next;
+	c->next = NULL;
+
+	return c;
+}
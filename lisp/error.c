@@ -7,10 +7,9 @@
 #include "lisp.h"
 
 struct value *
-error(struct location *loc, const char *fmt, ...)
+error(location loc, const char *fmt, ...)
 {
-	struct value *v = new_value(loc);
-	v->type = VAL_ERROR;
+	struct value *v = new_value(VAL_ERROR, loc);
 	v->loc = loc;
 
 	int l = strlen(fmt) + 1;
@@ -34,27 +33,28 @@ error(struct location *loc, const char *fmt, ...)
 void
 print_error(FILE *f, struct value *e)
 {
+	struct position p = find_position(e->loc);
+
 	fprintf(f, "%s: %s:%u:%u: %s\n\t",
 	        (char *[]){"error","note"}[e->type - VAL_ERROR],
-	        e->loc->file,
-	        e->loc->line + 1, e->loc->column, e->errmsg);
-
-	unsigned i = e->loc->idx;
-	const char *a = e->loc->text;
+	        p.file, p.line + 1, p.column, e->errmsg);
 
-	while (i && a[i] != '\n') i--;
-	if (a[i] == '\n') i++;
-	unsigned j = i;
+	const char *a = p.text;
+	unsigned i = p.idx - p.column, j = i;
 	while (a[i] && a[i] != '\n') fputc(a[i], f), i++;
 
 	fprintf(f, "\n\t");
 
-	for (unsigned i = 0; i < e->loc->column; i++)
+	for (unsigned i = 0; i < p.column; i++)
 		fputc(isspace(a[j + i]) ? a[j + i] : ' ', f);
 
 	fputc('^', f);
 
-	for (unsigned i = 1; i < e->loc->len; i++)
+	/* Only real sources have tokens to underline. */
+
+	unsigned len = e->loc > BUILTIN ? token_length(a + p.idx, p.end) : 0;
+
+	for (unsigned i = 1; i < len; i++)
 		fputc('~', f);
 
 	fputc('\n', f);
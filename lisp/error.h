@@ -4,7 +4,7 @@
 #include <stdio.h>
 #include "location.h"
 
-struct value *error(struct location *loc, const char *fmt, ...);
+struct value *error(location loc, const char *fmt, ...);
 void print_error(FILE *f, struct value *e);
 
 #endif
@@ -1,10 +1,68 @@
 #include <string.h>
+#include <stdbool.h>
 #include <assert.h>
 
 #include "error.h"
+#include "gc.h"
 #include "eval.h"
 #include "lisp.h"
 #include "util.h"
+#include "vm.h"
+#include "builtin.h"
+#include "profile.h"
+#include "stats.h"
+
+/*
+ * Looks up the value of `sym`. Symbols are interned and so can't
+ * tell us where any particular use of them was written; `loc` is the
+ * location of this use, for the error message.
+ */
+
+static struct value *
+lookup(struct value *env, struct value *sym, location loc)
+{
+	struct value **bind = find(env, sym);
+	if (!bind) return error(loc, "undeclared identifier");
+	return *bind;
+}
+
+/*
+ * Evaluates the element of the list cell `c`, using the location of
+ * the cell for symbols.
+ */
+
+static struct value *
+eval_car(struct value *env, struct value *c)
+{
+	if (TYPE(c->car) == VAL_SYMBOL)
+		return lookup(env, c->car, c->loc);
+	return eval(env, c->car);
+}
+
+/*
+ * Evaluates every element of `list` except for the last and returns
+ * the cell holding the last one, so that the caller can evaluate it
+ * in tail position. Returns NULL with the result in `*r` if there's
+ * nothing left to evaluate: either `list` was empty (and `*r` is nil)
+ * or an evaluation resulted in an error.
+ */
+
+static struct value *
+progn_tail(struct value *env, struct value *list, struct value **r)
+{
+	PROTECT(&env, &list);
+	*r = Nil;
+
+	for (;
+	     TYPE(list) == VAL_CELL;
+	     list = list->cdr) {
+		if (TYPE(list->cdr) != VAL_CELL) return list;
+		struct value *e = eval_car(env, list);
+		if (e && TYPE(e) == VAL_ERROR) return *r = e, NULL;
+	}
+
+	return NULL;
+}
 
 /*
  * Evaluates each element in `list` and returns the result of the last
@@ -16,58 +74,256 @@
 struct value *
 progn(struct value *env, struct value *list)
 {
-	struct value *r = NULL;
+	struct value *r;
+	PROTECT(&env);
+	struct value *last = progn_tail(env, list, &r);
 
-	for (struct value *lp = list;
-	     lp->type != VAL_NIL;
-	     lp = lp->cdr) {
-		r = eval(env, lp->car);
-		if (r && r->type == VAL_ERROR) return r;
-	}
+	return last ? eval_car(env, last) : r;
+}
+
+/*
+ * Returns the error for trying to call `fn`, which isn't a function,
+ * in `env`. The note points at where it was bound, if it was, and
+ * otherwise at where it came from.
+ */
 
-	return r ? r : Nil;
+struct value *
+call_error(struct value *env, location loc, struct value *fn)
+{
+	PROTECT(&env, &fn);
+	struct value *e =
+		error(loc, "function application requires " \
+		      "a function value (this is %s %s)",
+		      IS_VOWEL(*TYPE_NAME(TYPE(fn)))
+		      ? "an" : "a",
+		      TYPE_NAME(TYPE(fn)));
+	if (IS_INT(fn)) return e;
+	PROTECT(&e);
+	location where = find_binding(env, fn);
+	struct value *note = error(where ? where : fn->loc,
+	                           "last defined here");
+	note->type = VAL_NOTE;
+	e->cdr = note;
+	return e;
 }
 
 /*
- * Executes the body of the function or builtin `fn`. Returns an error
- * if `fn` is not a function or builtin.
+ * Evaluates the arguments `args` of a call to `fn` and returns the
+ * frame that its body should be executed in. Returns an error if `fn`
+ * is not a function.
  */
 
 static struct value *
-apply(struct value *env,
-      struct location *loc,
-      struct value *fn,
-      struct value *args)
+bind(struct value *env,
+     location loc,
+     struct value *fn,
+     struct value *args)
 {
-	if (fn->type == VAL_BUILTIN)
-		return fn->prim(env, args);
-
 	/* If it's not a builtin it must be a function. */
 
-	if (fn->type != VAL_FUNCTION) {
-		struct value *e =
-			error(loc, "function application requires " \
-			      "a function value (this is %s %s)",
-			      IS_VOWEL(*TYPE_NAME(fn->type))
-			      ? "an" : "a",
-			      TYPE_NAME(fn->type));
-		e->cdr = error(fn->loc, "last defined here");
-		e->cdr->type = VAL_NOTE;
-		return e;
-	}
+	if (TYPE(fn) != VAL_FUNCTION)
+		return call_error(env, loc, fn);
 
 	if (!IS_LIST(args))
-		return error(args->loc,
+		return error(LOC(args),
 		             "function application requires " \
 		             "a list of arguments (this is %s %s)",
-		             IS_VOWEL(*TYPE_NAME(args->car->type))
+		             IS_VOWEL(*TYPE_NAME(TYPE(args)))
 		             ? "an" : "a",
-		             TYPE_NAME(args->car->type));
+		             TYPE_NAME(TYPE(args)));
+
+	/*
+	 * Arguments are evaluated straight into the slots of the new
+	 * frame; only a rest parameter needs a list built for it.
+	 */
+
+	struct value *frame = NULL, *p = NULL;
+	PROTECT(&env, &fn, &args, &frame, &p);
+
+	frame = new_frame(fn->env, fn->param);
+	p = fn->param;
+
+	for (unsigned i = 0;
+	     TYPE(args) == VAL_CELL;
+	     args = args->cdr) {
+		if (TYPE(p) != VAL_CELL) {
+			if (TYPE(p) == VAL_NIL) {
+				struct value *arg = eval_car(env, args);
+				if (TYPE(arg) == VAL_ERROR) return arg;
+				continue;
+			}
+			struct value *rest = eval_list(env, args);
+			if (TYPE(rest) == VAL_ERROR) return rest;
+			frame->slot[i] = rest;
+			break;
+		}
+
+		struct value *arg = eval_car(env, args);
+		if (TYPE(arg) == VAL_ERROR) return arg;
+		frame->slot[i++] = arg;
+		p = p->cdr;
+	}
 
-	return progn(push_env(fn->env,
-	                      fn->param,
-	                      eval_list(env, args)),
-	             fn->body);
+	return frame;
+}
+
+/*
+ * Makes the frame for a call to the function `fn` with the values in
+ * `argv`, which has to be somewhere the collector can see it.
+ */
+
+struct value *
+make_frame(struct value *fn, unsigned argc, struct value **argv)
+{
+	struct value *frame = NULL, *rest = NULL;
+	PROTECT(&frame, &rest);
+
+	frame = new_frame(fn->env, fn->param);
+
+	struct value *p = frame->names;
+	unsigned i = 0;
+
+	for (; i < argc && TYPE(p) == VAL_CELL; i++, p = p->cdr)
+		frame->slot[i] = argv[i];
+
+	if (TYPE(p) != VAL_SYMBOL) return frame;
+
+	rest = Nil;
+
+	for (unsigned j = argc; j > i; j--) {
+		struct value *c = cons(argv[j - 1], rest);
+		rest = c;
+	}
+
+	frame->slot[frame->num_slot - 1] = rest;
+
+	return frame;
+}
+
+/*
+ * Calls `fn` with the values in `argv`, which has to be somewhere the
+ * collector can see it. Builtins that take their arguments
+ * unevaluated are given a list of forms that evaluate to them.
+ */
+
+struct value *
+invoke(struct value *env,
+       location loc,
+       struct value *fn,
+       unsigned argc,
+       struct value **argv)
+{
+	PROFILE_MARK(mark);
+
+	if (TYPE(fn) == VAL_BUILTIN && !fn->prim) {
+		if ((int)argc >= fn->min_arg
+		    && (fn->max_arg < 0 || (int)argc <= fn->max_arg)) {
+			if (profiling) profile_call(fn, false);
+			return fn->fun(env, loc, argc, argv);
+		}
+		if (fn->min_arg == fn->max_arg)
+			return error(loc, "builtin `%s' takes %d argument%s",
+			             fn->prim_name, fn->min_arg,
+			             fn->min_arg == 1 ? "" : "s");
+		if (fn->max_arg < 0)
+			return error(loc, "builtin `%s' takes at least %d"
+			             " argument%s", fn->prim_name, fn->min_arg,
+			             fn->min_arg == 1 ? "" : "s");
+		return error(loc, "builtin `%s' takes %d to %d arguments",
+		             fn->prim_name, fn->min_arg, fn->max_arg);
+	}
+
+	PROTECT(&env, &fn);
+
+	if (TYPE(fn) == VAL_BUILTIN) {
+		struct value *args = Nil, *a = NULL;
+		PROTECT(&args, &a);
+
+		for (unsigned i = argc; i; i--) {
+			a = argv[i - 1];
+
+			switch (TYPE(a)) {
+			case VAL_INT:     case VAL_STRING:
+			case VAL_BUILTIN: case VAL_FUNCTION:
+			case VAL_ARRAY:   case VAL_TRUE:
+			case VAL_NIL:     case VAL_REGEX:
+			case VAL_HASH:    case VAL_ROPE:
+			case VAL_SEQ:
+				break;
+			default:
+				a = quote(a);
+			}
+
+			args = cons(a, args);
+
+			/* Integers don't have a location of their own. */
+			if (IS_INT(a)) args->loc = loc;
+		}
+
+		if (profiling) profile_call(fn, false);
+		return fn->prim(env, args);
+	}
+
+	if (TYPE(fn) != VAL_FUNCTION)
+		return call_error(env, loc, fn);
+
+	struct value *frame = make_frame(fn, argc, argv);
+	if (profiling) profile_call(fn, false);
+	if (use_vm) return vm_apply(fn, frame);
+
+	return progn(frame, fn->body);
+}
+
+/*
+ * Arguments to builtins that take their arguments evaluated are kept
+ * here while they're being evaluated and for the duration of the
+ * call. It never moves, so the builtin can be handed a pointer into
+ * it.
+ */
+
+#define ARG_STACK_SIZE (1 << 16)
+
+static struct value *arg_stack[ARG_STACK_SIZE];
+static unsigned num_arg;
+
+static void
+walk_args(gc_visitor *visit)
+{
+	for (unsigned i = 0; i < num_arg; i++)
+		visit(&arg_stack[i]);
+}
+
+static struct value *
+call_native(struct value *env, struct value *v, struct value *fn)
+{
+	static bool rooted = false;
+	if (!rooted) gc_roots(walk_args), rooted = true;
+
+	unsigned base = num_arg;
+	struct value *p = v->cdr, *r = NULL;
+	PROTECT(&env, &v, &fn, &p);
+
+	for (; TYPE(p) == VAL_CELL; p = p->cdr) {
+		r = eval_car(env, p);
+		if (TYPE(r) == VAL_ERROR) goto out;
+
+		if (num_arg == ARG_STACK_SIZE) {
+			r = error(v->loc, "too many arguments");
+			goto out;
+		}
+
+		arg_stack[num_arg++] = r;
+	}
+
+	if (TYPE(p) != VAL_NIL)
+		r = error(LOC(p), "function application requires"
+		          " a list of arguments");
+	else
+		r = invoke(env, v->loc, fn, num_arg - base, arg_stack + base);
+
+out:
+	num_arg = base;
+	return r;
 }
 
 /*
@@ -80,19 +336,22 @@ struct value *
 eval_list(struct value *env, struct value *list)
 {
 	struct value *head = NULL, *tail = NULL;
+	PROTECT(&env, &list, &head, &tail);
+	stats.list++;
 
-	for (struct value *l = list;
-	     l->type != VAL_NIL;
-	     l = l->cdr) {
-		struct value *tmp = eval(env, l->car);
+	for (;
+	     TYPE(list) != VAL_NIL;
+	     list = list->cdr) {
+		struct value *tmp = eval_car(env, list);
 		if (!tmp) return Nil;
-		if (tmp->type == VAL_ERROR) return tmp;
+		if (TYPE(tmp) == VAL_ERROR) return tmp;
 		if (!head) {
 			head = tail = cons(tmp, Nil);
 			continue;
 		}
-		tail->cdr = cons(tmp, Nil);
-		tail = tail->cdr;
+		struct value *c = cons(tmp, Nil);
+		tail->cdr = c;
+		tail = c;
 	}
 
 	return head ? head : Nil;
@@ -100,12 +359,23 @@ eval_list(struct value *env, struct value *list)
 
 /*
  * Evaluates a node and returns the result.
+ *
+ * Forms in tail position (the branches of an `if', the last form of a
+ * `progn' and the last form in the body of a function) are evaluated
+ * by going around the loop again rather than by recursing, so a
+ * function that calls itself in tail position runs in constant C
+ * stack.
  */
 
 struct value *
 eval(struct value *env, struct value *v)
 {
-	switch (v->type) {
+	struct value *fn = NULL, *r = NULL;
+	PROTECT(&env, &v, &fn);
+	PROFILE_MARK(mark);
+
+again:
+	switch (TYPE(v)) {
 	/*
 	 * These are values that don't require any further
 	 * interpretation.
@@ -115,6 +385,8 @@ eval(struct value *env, struct value *v)
 	case VAL_BUILTIN: case VAL_FUNCTION:
 	case VAL_ERROR:   case VAL_ARRAY:
 	case VAL_TRUE:    case VAL_NIL:
+	case VAL_REGEX:   case VAL_HASH:
+	case VAL_ROPE:    case VAL_SEQ:
 		return v;
 
 	/*
@@ -124,11 +396,47 @@ eval(struct value *env, struct value *v)
 
 	case VAL_CELL: {
 		struct value *expanded = expand(env, v);
-		if (expanded != v) return eval(env, expanded);
-		struct value *fn = eval(env, v->car);
-		struct value *args = v->cdr;
-		if (fn->type == VAL_ERROR) return fn;
-		return apply(env, v->loc, fn, args);
+		if (expanded != v) {
+			v = expanded;
+			goto again;
+		}
+
+		fn = eval_car(env, v);
+		if (TYPE(fn) == VAL_ERROR) return fn;
+
+		if (TYPE(fn) == VAL_BUILTIN && fn->prim == builtin_if) {
+			struct value *c = eval(env, v->cdr->car);
+			if (TYPE(c) == VAL_ERROR) return c;
+			if (TYPE(c) == VAL_TRUE) {
+				v = v->cdr->cdr->car;
+				goto again;
+			}
+			v = progn_tail(env, v->cdr->cdr->cdr, &r);
+		} else if (TYPE(fn) == VAL_BUILTIN
+		           && fn->prim == builtin_progn) {
+			v = progn_tail(env, v->cdr, &r);
+		} else if (TYPE(fn) == VAL_BUILTIN) {
+			if (!fn->prim) return call_native(env, v, fn);
+			if (profiling) profile_call(fn, false);
+			return fn->prim(env, v->cdr);
+		} else {
+			struct value *frame = bind(env, v->loc, fn, v->cdr);
+			if (TYPE(frame) == VAL_ERROR) return frame;
+
+			/* A tail call replaces the one that made it. */
+			if (profiling) profile_call(fn, profile_depth > mark);
+
+			if (use_vm) return vm_apply(fn, frame);
+			env = frame;
+			v = progn_tail(env, fn->body, &r);
+		}
+
+		/* `v' is now the cell holding the form in tail position. */
+
+		if (!v) return r;
+		if (TYPE(v->car) == VAL_SYMBOL) return eval_car(env, v);
+		v = v->car;
+		goto again;
 	}
 
 	/*
@@ -136,11 +444,11 @@ eval(struct value *env, struct value *v)
 	 * means and return that.
 	 */
 
-	case VAL_SYMBOL: {
-		struct value *bind = find(env, v);
-		if (bind) return bind->cdr->loc = bind->car->loc, bind->cdr;
-		return error(v->loc, "undeclared identifier");
-	}
+	case VAL_SYMBOL:
+		return lookup(env, v, v->loc);
+
+	case VAL_LOCAL:
+		return *local(env, v);
 
 	/* This should never happen. */
 
@@ -1,8 +1,19 @@
 #ifndef EVAL_H
 #define EVAL_H
 
+#include "lisp.h"
+
 struct value *progn(struct value *env, struct value *list);
 struct value *eval_list(struct value *env, struct value *list);
 struct value *eval(struct value *env, struct value *v);
+struct value *call_error(struct value *env, location loc, struct value *fn);
+struct value *make_frame(struct value *fn,
+                         unsigned argc,
+                         struct value **argv);
+struct value *invoke(struct value *env,
+                     location loc,
+                     struct value *fn,
+                     unsigned argc,
+                     struct value **argv);
 
 #endif
@@ -0,0 +1,368 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc.h"
+#include "lisp.h"
+#include "vm.h"
+#include "hash.h"
+#include "stats.h"
+
+#define HEAP_SIZE (4 << 20)
+#define ALIGN(X) (((X) + sizeof (void *) - 1) & ~(sizeof (void *) - 1))
+
+/*
+ * `from` is the space being allocated out of and `to` is the spare
+ * semispace that the next collection will evacuate into. Both are
+ * always `size` bytes large.
+ */
+
+static struct {
+	char *from, *to;
+	size_t size, used;
+} heap;
+
+/*
+ * Roots come in two flavours: permanent ones registered once with
+ * `gc_root()`, and the stack of temporary ones managed by
+ * `PROTECT()`. An entry on the stack covers `num` consecutive
+ * pointers so that arrays can be protected in one go.
+ */
+
+static struct value ***root;
+static unsigned num_root, cap_root;
+
+static void (**walker)(gc_visitor *);
+static unsigned num_walker;
+
+static struct {
+	struct value **p;
+	unsigned num;
+} *stack;
+static unsigned top, cap;
+
+void
+gc_root(struct value **p)
+{
+	if (num_root == cap_root) {
+		cap_root = cap_root ? cap_root * 2 : 16;
+		root = realloc(root, cap_root * sizeof *root);
+	}
+
+	root[num_root++] = p;
+}
+
+/*
+ * Registers a function that knows how to find roots stored in some
+ * structure of its own, like the symbol table.
+ */
+
+void
+gc_roots(void (*walk)(gc_visitor *))
+{
+	walker = realloc(walker, (num_walker + 1) * sizeof *walker);
+	walker[num_walker++] = walk;
+}
+
+unsigned
+gc_protect_n(struct value **p, unsigned num)
+{
+	if (top == cap) {
+		cap = cap ? cap * 2 : 256;
+		stack = realloc(stack, cap * sizeof *stack);
+	}
+
+	stack[top].p = p;
+	stack[top].num = num;
+
+	return top++;
+}
+
+unsigned
+gc_protect(struct value **p[], unsigned num)
+{
+	unsigned r = top;
+	for (unsigned i = 0; i < num; i++) gc_protect_n(p[i], 1);
+	return r;
+}
+
+void
+gc_unprotect(unsigned *old)
+{
+	top = *old;
+}
+
+static size_t
+value_size(struct value *v)
+{
+	if (v->type == VAL_ENV)
+		return ALIGN(sizeof *v + v->num_slot * sizeof *v->slot);
+	return ALIGN(sizeof *v);
+}
+
+/*
+ * Releases the out-of-heap storage owned by a value that didn't
+ * survive a collection.
+ */
+
+static void
+finalize(struct value *v)
+{
+	switch (v->type) {
+	case VAL_STRING: kdgu_free(v->s);  free(v->crumb); break;
+	case VAL_SYMBOL: kdgu_free(v->s);  break;
+	case VAL_ERROR:
+	case VAL_NOTE:   free(v->errmsg);  break;
+	case VAL_ARRAY:  free(v->arr);     break;
+	case VAL_HASH:   free(v->slots);   break;
+	case VAL_FUNCTION:
+	case VAL_MACRO:  free_code(v->code); break;
+	case VAL_REGEX:
+		kdgu_free(v->pattern);
+		ktre_free(v->re);
+		break;
+	default:;
+	}
+}
+
+/*
+ * Calls `visit` on every value pointer stored inside of `v`.
+ */
+
+static void
+trace(struct value *v, gc_visitor *visit)
+{
+	switch (v->type) {
+	case VAL_CELL:
+		visit(&v->car);
+		visit(&v->cdr);
+		visit(&v->expansion);
+		break;
+	case VAL_FUNCTION:
+	case VAL_MACRO:
+		visit(&v->param);
+		visit(&v->body);
+		visit(&v->env);
+		if (v->code) trace_code(v->code, visit);
+		break;
+	case VAL_ENV:
+		visit(&v->vars);
+		visit(&v->up);
+		visit(&v->names);
+		for (unsigned i = 0; i < v->num_slot; i++)
+			visit(&v->slot[i]);
+		break;
+	case VAL_SYMBOL:
+		visit(&v->global);
+		visit(&v->global_env);
+		break;
+	case VAL_LOCAL:
+		visit(&v->name);
+		break;
+	case VAL_ARRAY:
+		for (unsigned i = 0; i < v->num; i++)
+			visit(&v->arr[i]);
+		break;
+	case VAL_SEQ:
+		visit(&v->source);
+		visit(&v->proc);
+		visit(&v->state);
+		break;
+	case VAL_ROPE:
+		visit(&v->left);
+		visit(&v->right);
+		visit(&v->flat);
+		break;
+	case VAL_HASH:
+		for (unsigned i = 0; i < v->cap_slot; i++)
+			if (v->slots[i].key) {
+				visit(&v->slots[i].key);
+				visit(&v->slots[i].val);
+			}
+		break;
+	case VAL_ERROR:
+	case VAL_NOTE:
+		visit(&v->cdr);
+		break;
+	default:;
+	}
+}
+
+static char *old;
+static size_t old_size, copied;
+
+/*
+ * Moves `*p` into to-space if it hasn't been already and updates
+ * `*p` to point to the new copy. Values that don't live in the heap
+ * (like `Nil`, `True` and integers) are left alone.
+ */
+
+static void
+copy(struct value **p)
+{
+	struct value *v = *p;
+
+	if (!v || IS_INT(v)
+	    || (char *)v < old || (char *)v >= old + old_size)
+		return;
+
+	if (v->type == VAL_MOVED) {
+		*p = v->car;
+		return;
+	}
+
+	size_t size = value_size(v);
+	struct value *n = (struct value *)(heap.from + copied);
+
+	memcpy(n, v, size);
+	copied += size;
+
+	v->type = VAL_MOVED;
+	v->car = n;
+	*p = n;
+}
+
+/*
+ * Evacuates every live value into a fresh semispace of `size` bytes.
+ */
+
+static void
+collect(size_t size)
+{
+	old = heap.from;
+	old_size = heap.size;
+	size_t used = heap.used;
+
+	/* The heap's never fuller than just before it's collected. */
+	if (used > stats.peak_live) stats.peak_live = used;
+
+	if (size == heap.size && heap.to) {
+		heap.from = heap.to;
+	} else {
+		free(heap.to);
+		heap.from = malloc(size);
+	}
+
+	heap.to = NULL;
+	heap.size = size;
+	copied = 0;
+
+	for (unsigned i = 0; i < num_root; i++)
+		copy(root[i]);
+
+	for (unsigned i = 0; i < num_walker; i++)
+		walker[i](copy);
+
+	for (unsigned i = 0; i < top; i++)
+		for (unsigned j = 0; j < stack[i].num; j++)
+			copy(stack[i].p + j);
+
+	for (char *scan = heap.from;
+	     scan < heap.from + copied;
+	     scan += value_size((struct value *)scan))
+		trace((struct value *)scan, copy);
+
+	heap.used = copied;
+	stats.collection++;
+	if (2 * size > stats.peak_heap) stats.peak_heap = 2 * size;
+
+	/*
+	 * Everything left behind in the old space is garbage; walk it
+	 * once to free whatever it owned outside of the heap.
+	 */
+
+	for (char *scan = old;
+	     scan < old + used;) {
+		struct value *v = (struct value *)scan;
+
+		if (v->type == VAL_MOVED) {
+			scan += value_size(v->car);
+			continue;
+		}
+
+		finalize(v);
+		scan += value_size(v);
+	}
+
+#ifdef GC_STRESS
+	free(old);
+#else
+	if (old_size == size) heap.to = old;
+	else free(old);
+#endif
+}
+
+void
+gc(void)
+{
+	if (heap.from) collect(heap.size);
+}
+
+/*
+ * Returns the number of bytes that have been allocated in the current
+ * space, live or not.
+ */
+
+size_t
+gc_used(void)
+{
+	return heap.used;
+}
+
+/*
+ * Whether any value in the heap other than a symbol is located in
+ * [`lo`, `hi`). Everything in the heap counts, so this only says
+ * whether a live value is if it's called just after `gc()`.
+ */
+
+bool
+gc_refers(location lo, location hi)
+{
+	for (char *scan = heap.from;
+	     scan && scan < heap.from + heap.used;
+	     scan += value_size((struct value *)scan)) {
+		struct value *v = (struct value *)scan;
+		if (v->type != VAL_SYMBOL && v->loc >= lo && v->loc < hi)
+			return true;
+	}
+
+	return false;
+}
+
+void *
+gc_alloc(size_t size)
+{
+	size = ALIGN(size);
+
+	if (!heap.from) {
+		heap.from = malloc(HEAP_SIZE);
+		heap.size = HEAP_SIZE;
+		stats.peak_heap = 2 * HEAP_SIZE;
+	}
+
+#ifdef GC_STRESS
+	collect(heap.size);
+#endif
+
+	if (heap.used + size > heap.size) {
+		collect(heap.size);
+
+		/*
+		 * Keep at least half of the heap free after a
+		 * collection so that we don't end up collecting on
+		 * nearly every allocation.
+		 */
+
+		size_t want = heap.size;
+		while ((heap.used + size) * 2 > want) want *= 2;
+		if (want != heap.size) collect(want);
+	}
+
+	void *p = heap.from + heap.used;
+	heap.used += size;
+	memset(p, 0, size);
+
+	stats.alloc++;
+	stats.allocated += size;
+
+	return p;
+}
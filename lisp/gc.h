@@ -0,0 +1,52 @@
+#ifndef GC_H
+#define GC_H
+
+#include <stddef.h>
+#include "lisp.h"
+
+/*
+ * The heap is a pair of semispaces. Values are bump-allocated out of
+ * the current space and a Cheney-style copying collection evacuates
+ * everything reachable from the roots into the other space when the
+ * current one fills up.
+ *
+ * Because values move, any `struct value *` that lives in a C
+ * variable across a call that might allocate must be registered as a
+ * root for the duration of that call. `PROTECT()` does this for the
+ * rest of the enclosing scope:
+ *
+ *   PROTECT(&env, &list);
+ *
+ * The roots are popped automatically when the scope is left, so early
+ * returns need no extra bookkeeping.
+ */
+
+typedef void gc_visitor(struct value **);
+
+void *gc_alloc(size_t size);
+void gc(void);
+size_t gc_used(void);
+bool gc_refers(location lo, location hi);
+
+void gc_root(struct value **root);
+void gc_roots(void (*walk)(gc_visitor *visit));
+
+unsigned gc_protect(struct value **roots[], unsigned num);
+unsigned gc_protect_n(struct value **roots, unsigned num);
+void gc_unprotect(unsigned *top);
+
+#define GC_CAT_(X, Y) X##Y
+#define GC_CAT(X, Y) GC_CAT_(X, Y)
+
+#define PROTECT(...)	  \
+	unsigned GC_CAT(gc_top_, __LINE__) \
+	__attribute__((cleanup(gc_unprotect))) = \
+		gc_protect((struct value **[]){__VA_ARGS__}, \
+		           sizeof (struct value **[]){__VA_ARGS__} \
+		           / sizeof (struct value **))
+
+#define PROTECT_N(X, N)	  \
+	unsigned GC_CAT(gc_top_, __LINE__) \
+	__attribute__((cleanup(gc_unprotect))) = gc_protect_n(X, N)
+
+#endif
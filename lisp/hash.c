@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "lisp.h"
+
+/*
+ * Hash tables. A table is one open-addressed array of slots, probed
+ * linearly, each holding a key, its value and the key's hash, so that
+ * a lookup usually touches a single cache line and growing the table
+ * never hashes a key again.
+ *
+ * Keys are integers, strings and symbols: the things that hash the
+ * same wherever the collector moves them. Strings are equal if their
+ * bytes are, and a string is never equal to the symbol of the same
+ * name. A removed key leaves a slot with no key and a value of nil
+ * behind, which lookups go past and insertions reuse.
+ */
+
+static size_t
+hash_key(struct value *key)
+{
+	if (IS_INT(key))
+		return (uintptr_t)key * 0x9e3779b97f4a7c15ULL >> 16;
+	if (key->type == VAL_SYMBOL) return key->hash;
+	return hash_bytes(key->s->s, key->s->len) ^ 0x5bd1e995;
+}
+
+static bool
+same_key(struct value *a, struct value *b)
+{
+	if (a == b) return true;
+	if (IS_INT(a) || IS_INT(b) || a->type != VAL_STRING
+	    || b->type != VAL_STRING)
+		return false;
+	return a->s->len == b->s->len && !memcmp(a->s->s, b->s->s, a->s->len);
+}
+
+bool
+hashable(struct value *key)
+{
+	return IS_INT(key) || TYPE(key) == VAL_STRING
+		|| TYPE(key) == VAL_SYMBOL;
+}
+
+/*
+ * Makes a hash table with room for `num` keys before it has to grow.
+ */
+
+struct value *
+new_hash(location loc, unsigned num)
+{
+	unsigned cap = 8;
+	while (num * 2 > cap) cap *= 2;
+
+	struct value *h = new_value(VAL_HASH, loc);
+	h->slots = calloc(cap, sizeof *h->slots);
+	h->cap_slot = cap;
+
+	return h;
+}
+
+/*
+ * Returns the slot holding `key`, or if there isn't one the slot it
+ * would be put in.
+ */
+
+static struct hash_slot *
+probe(struct value *h, struct value *key, size_t hash)
+{
+	unsigned mask = h->cap_slot - 1;
+	struct hash_slot *dead = NULL;
+
+	for (unsigned i = hash & mask;; i = (i + 1) & mask) {
+		struct hash_slot *s = &h->slots[i];
+
+		if (!s->key) {
+			if (!s->val) return dead ? dead : s;
+			if (!dead) dead = s;
+			continue;
+		}
+
+		if (s->hash == hash && same_key(s->key, key)) return s;
+	}
+}
+
+/*
+ * Returns where the value of `key` is kept in `h`, or NULL if it isn't
+ * there.
+ */
+
+struct value **
+hash_find(struct value *h, struct value *key)
+{
+	struct hash_slot *s = probe(h, key, hash_key(key));
+	return s->key ? &s->val : NULL;
+}
+
+static void
+grow(struct value *h)
+{
+	struct hash_slot *old = h->slots;
+	unsigned cap = h->cap_slot;
+
+	/* Only grow if the removed keys aren't what's filling it. */
+
+	if (h->num_key * 2 >= cap / 2) h->cap_slot *= 2;
+	h->slots = calloc(h->cap_slot, sizeof *h->slots);
+	h->num_dead = 0;
+
+	unsigned mask = h->cap_slot - 1;
+
+	for (unsigned i = 0; i < cap; i++) {
+		if (!old[i].key) continue;
+		unsigned j = old[i].hash & mask;
+		while (h->slots[j].key) j = (j + 1) & mask;
+		h->slots[j] = old[i];
+	}
+
+	free(old);
+}
+
+/*
+ * Sets the value of `key` in `h` to `v`. Nothing's allocated on the
+ * heap, so neither can move.
+ */
+
+void
+hash_put(struct value *h, struct value *key, struct value *v)
+{
+	size_t hash = hash_key(key);
+	struct hash_slot *s = probe(h, key, hash);
+
+	if (s->key) {
+		s->val = v;
+		return;
+	}
+
+	if (s->val) {
+		h->num_dead--;
+	} else if ((h->num_key + h->num_dead + 1) * 2 > h->cap_slot) {
+		grow(h);
+		s = probe(h, key, hash);
+	}
+
+	*s = (struct hash_slot){ key, v, hash };
+	h->num_key++;
+}
+
+bool
+hash_remove(struct value *h, struct value *key)
+{
+	struct hash_slot *s = probe(h, key, hash_key(key));
+	if (!s->key) return false;
+
+	*s = (struct hash_slot){ NULL, Nil, 0 };
+	h->num_key--;
+	h->num_dead++;
+
+	return true;
+}
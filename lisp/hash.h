@@ -0,0 +1,20 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdbool.h>
+#include "lisp.h"
+
+/* A slot in a hash table, empty if `key` and `val` are both NULL. */
+
+struct hash_slot {
+	struct value *key, *val;
+	size_t hash;
+};
+
+struct value *new_hash(location loc, unsigned num);
+bool hashable(struct value *key);
+struct value **hash_find(struct value *h, struct value *key);
+void hash_put(struct value *h, struct value *key, struct value *v);
+bool hash_remove(struct value *h, struct value *key);
+
+#endif
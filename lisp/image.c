@@ -0,0 +1,732 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gc.h"
+#include "image.h"
+#include "lisp.h"
+#include "stats.h"
+#include "hash.h"
+#include "rope.h"
+#include "seq.h"
+
+/*
+ * Heap images. An image holds either the global bindings of an
+ * environment or a single value, everything that refers to, and the
+ * text of the sources that any of it came from, so that locations
+ * still point at the right things. Values refer to each other by
+ * index rather than by address, and builtins are saved by name and
+ * looked up again in the environment that the image is loaded into.
+ *
+ * An image is a sequence of 64-bit words:
+ *
+ *   magic, number of sources, number of values, number of bindings,
+ *   the value, where the sources start
+ *   for each value:   type | loc << 32, then what depends on the type
+ *   for each binding: symbol, value
+ *   for each source:  file, text
+ *
+ * Strings are a length followed by the bytes and a NUL, padded out to
+ * a whole number of words. A reference to a value is a word holding
+ * either an integer, tagged as usual, or one of the `REF_` numbers
+ * below shifted up by one.
+ *
+ * Locations are saved as if the image's sources were the only ones
+ * there are, so they're moved to wherever the sources end up when
+ * they're loaded again.
+ */
+
+#define MAGIC 0x33474d494b4554ULL /* "TEKIMG3" */
+
+enum {
+	REF_NULL,
+	REF_NIL,
+	REF_TRUE,
+	REF_GLOBAL,   /* The environment itself.       */
+	REF_FIRST     /* The first value in the image. */
+};
+
+#define WORDS(N) (((N) + 8) / 8) /* Words taken by N bytes and a NUL. */
+
+struct saver {
+	struct value *env;
+
+	uint64_t *w;              /* The image so far.        */
+	size_t num_w, cap_w;
+
+	struct value **val;       /* Values in the image.     */
+	size_t *at;               /* Where each one starts.   */
+	size_t num_val, cap_val;
+
+	struct value **key;       /* Hash of `val` indices.   */
+	size_t *idx, cap_key;
+};
+
+static void
+put(struct saver *s, uint64_t w)
+{
+	if (s->num_w == s->cap_w) {
+		s->cap_w = s->cap_w ? s->cap_w * 2 : 1024;
+		s->w = realloc(s->w, s->cap_w * sizeof *s->w);
+	}
+
+	s->w[s->num_w++] = w;
+}
+
+static void
+put_bytes(struct saver *s, const char *p, size_t len)
+{
+	put(s, len);
+
+	size_t at = s->num_w;
+	for (size_t i = 0; i < WORDS(len); i++) put(s, 0);
+	memcpy(s->w + at, p, len);
+}
+
+static size_t
+hash_pointer(struct value *v)
+{
+	return ((uintptr_t)v >> 4) * 0x9e3779b97f4a7c15ULL;
+}
+
+/*
+ * Returns the index of `v` in the image, adding it to the end if it
+ * isn't there already.
+ */
+
+static size_t
+index_of(struct saver *s, struct value *v)
+{
+	if (s->num_val * 2 >= s->cap_key) {
+		size_t cap = s->cap_key ? s->cap_key * 2 : 1024;
+		struct value **key = calloc(cap, sizeof *key);
+		size_t *idx = malloc(cap * sizeof *idx);
+
+		for (size_t i = 0; i < s->cap_key; i++) {
+			if (!s->key[i]) continue;
+			size_t j = hash_pointer(s->key[i]) & (cap - 1);
+			while (key[j]) j = (j + 1) & (cap - 1);
+			key[j] = s->key[i];
+			idx[j] = s->idx[i];
+		}
+
+		free(s->key), free(s->idx);
+		s->key = key, s->idx = idx, s->cap_key = cap;
+	}
+
+	size_t i = hash_pointer(v) & (s->cap_key - 1);
+
+	for (; s->key[i]; i = (i + 1) & (s->cap_key - 1))
+		if (s->key[i] == v) return s->idx[i];
+
+	if (s->num_val == s->cap_val) {
+		s->cap_val = s->cap_val ? s->cap_val * 2 : 1024;
+		s->val = realloc(s->val, s->cap_val * sizeof *s->val);
+		s->at = realloc(s->at, s->cap_val * sizeof *s->at);
+	}
+
+	s->key[i] = v;
+	s->idx[i] = s->num_val;
+	s->val[s->num_val] = v;
+
+	return s->num_val++;
+}
+
+static uint64_t
+ref(struct saver *s, struct value *v)
+{
+	if (IS_INT(v)) return (uintptr_t)v;
+	if (!v) return REF_NULL << 1;
+	if (v == Nil) return REF_NIL << 1;
+	if (v == True) return REF_TRUE << 1;
+	if (v == s->env) return REF_GLOBAL << 1;
+	return (REF_FIRST + index_of(s, v)) << 1;
+}
+
+static void
+save_value(struct saver *s, struct value *v)
+{
+	put(s, v->type | (uint64_t)v->loc << 32);
+
+	switch (v->type) {
+	case VAL_CELL:
+		put(s, ref(s, v->car));
+		put(s, ref(s, v->cdr));
+		break;
+	case VAL_STRING:
+	case VAL_SYMBOL:
+		put_bytes(s, v->s->s, v->s->len);
+		break;
+	case VAL_BUILTIN:
+		put_bytes(s, v->prim_name, strlen(v->prim_name));
+		break;
+	case VAL_FUNCTION:
+	case VAL_MACRO:
+		put(s, ref(s, v->param));
+		put(s, ref(s, v->body));
+		put(s, ref(s, v->env));
+		break;
+	case VAL_ENV:
+		put(s, v->num_slot);
+		put(s, ref(s, v->vars));
+		put(s, ref(s, v->up));
+		put(s, ref(s, v->names));
+		for (unsigned i = 0; i < v->num_slot; i++)
+			put(s, ref(s, v->slot[i]));
+		break;
+	case VAL_ARRAY:
+		put(s, v->num);
+		for (unsigned i = 0; i < v->num; i++)
+			put(s, ref(s, v->arr[i]));
+		break;
+	case VAL_LOCAL:
+		put(s, ref(s, v->name));
+		put(s, v->depth | (uint64_t)v->index << 32);
+		break;
+	case VAL_SEQ:
+		put(s, v->kind);
+		put(s, ref(s, v->source));
+		put(s, ref(s, v->proc));
+		put(s, ref(s, v->state));
+		break;
+	case VAL_ROPE:
+		put(s, ref(s, v->left));
+		put(s, ref(s, v->right));
+		put(s, v->length | (uint64_t)v->height << 32);
+		break;
+	case VAL_HASH:
+		put(s, v->num_key);
+		for (unsigned i = 0; i < v->cap_slot; i++) {
+			if (!v->slots[i].key) continue;
+			put(s, ref(s, v->slots[i].key));
+			put(s, ref(s, v->slots[i].val));
+		}
+		break;
+	case VAL_REGEX:
+		put_bytes(s, v->pattern->s, v->pattern->len);
+		put(s, v->opt);
+		break;
+	case VAL_ERROR:
+	case VAL_NOTE:
+		put_bytes(s, v->errmsg, strlen(v->errmsg));
+		put(s, ref(s, v->cdr));
+		break;
+	default:;
+	}
+}
+
+/*
+ * Rewrites the locations of the values in the image as if the sources
+ * that they're from were the only ones, and writes those sources out.
+ */
+
+static unsigned
+save_sources(struct saver *s)
+{
+	unsigned num = 0, num_used = 0;
+	const char *file, *text;
+	size_t len;
+
+	while (get_source(num, &file, &text, &len)) num++;
+
+	location *base = calloc(num + 1, sizeof *base);
+
+	for (size_t i = 0; i < s->num_val; i++) {
+		location loc = s->w[s->at[i]] >> 32;
+		if (loc > BUILTIN) base[find_source(loc)] = 1;
+	}
+
+	for (unsigned i = 0, next = BUILTIN + 1; i < num; i++) {
+		if (!base[i]) continue;
+		location was = get_source(i, &file, &text, &len);
+		base[i] = next - was;
+		next += len + 1;
+		put_bytes(s, file, strlen(file));
+		put_bytes(s, text, len);
+		num_used++;
+	}
+
+	for (size_t i = 0; i < s->num_val; i++) {
+		uint64_t *w = &s->w[s->at[i]];
+		location loc = *w >> 32;
+		if (loc <= BUILTIN) continue;
+		loc += base[find_source(loc)];
+		*w = (*w & 0xffffffff) | (uint64_t)loc << 32;
+	}
+
+	free(base);
+
+	return num_used;
+}
+
+/*
+ * Writes an image to `path`. If `extra` is NULL the image holds the
+ * global bindings of `env`, and otherwise just `extra`. Nothing is
+ * allocated, so the heap stays put while it's being walked.
+ */
+
+bool
+save_image(const char *path, struct value *env, struct value *extra)
+{
+	struct saver s = { .env = env };
+
+	for (unsigned i = 0; i < 6; i++) put(&s, 0);
+
+	/*
+	 * Everything the bindings refer to gets an index now; the
+	 * values are then written in index order, which picks up
+	 * whatever they refer to in turn.
+	 */
+
+	struct value *tab = env->vars;
+	unsigned num_binding = !extra && TYPE(tab) == VAL_ARRAY
+		? env->num_global : 0;
+	uint64_t *binding = malloc((2 * num_binding + 1) * sizeof *binding);
+
+	for (unsigned i = 0, j = 0; j < 2 * num_binding; i++) {
+		if (!tab->arr[i]) continue;
+		binding[j++] = ref(&s, tab->arr[i]->car);
+		binding[j++] = ref(&s, tab->arr[i]->cdr);
+	}
+
+	s.w[4] = ref(&s, extra);
+
+	for (size_t i = 0; i < s.num_val; i++) {
+		s.at[i] = s.num_w;
+		save_value(&s, s.val[i]);
+	}
+
+	for (unsigned i = 0; i < 2 * num_binding; i++)
+		put(&s, binding[i]);
+
+	s.w[5] = s.num_w;
+	s.w[1] = save_sources(&s);
+	s.w[0] = MAGIC;
+	s.w[2] = s.num_val;
+	s.w[3] = num_binding;
+
+	FILE *f = fopen(path, "wb");
+	bool ok = f && fwrite(s.w, sizeof *s.w, s.num_w, f) == s.num_w;
+	if (f && fclose(f)) ok = false;
+
+	free(binding);
+	free(s.w), free(s.val), free(s.at), free(s.key), free(s.idx);
+
+	return ok;
+}
+
+/*
+ * The values of the image that's being loaded. They're allocated
+ * before anything that refers to them is filled in, so they have to
+ * be kept alive and up to date in between.
+ */
+
+static struct value **loaded;
+static size_t num_loaded;
+
+static void
+walk_loaded(gc_visitor *visit)
+{
+	for (size_t i = 0; i < num_loaded; i++)
+		visit(&loaded[i]);
+}
+
+static struct value *
+deref(uint64_t w, struct value *env, bool *ok)
+{
+	if (w & 1) return (struct value *)(uintptr_t)w;
+
+	switch (w >>= 1) {
+	case REF_NULL:   return NULL;
+	case REF_NIL:    return Nil;
+	case REF_TRUE:   return True;
+	case REF_GLOBAL: return env;
+	}
+
+	if (w - REF_FIRST < num_loaded) return loaded[w - REF_FIRST];
+
+	*ok = false;
+	return Nil;
+}
+
+/*
+ * Makes a regex out of the record at `p`, whose pattern is `n` bytes
+ * long, or returns NULL if the pattern doesn't compile any more.
+ */
+
+static struct value *
+load_regex(const uint64_t *p, size_t n, location loc)
+{
+	int opt = p[2 + WORDS(n)];
+	kdgu *pattern = kdgu_news((const char *)(p + 2));
+	ktre *re = ktre_compile(pattern, opt);
+
+	if (!re || re->err) {
+		if (re) ktre_free(re);
+		kdgu_free(pattern);
+		return NULL;
+	}
+
+	struct value *v = new_value(VAL_REGEX, loc);
+	v->pattern = pattern;
+	v->re = re;
+	v->opt = opt;
+
+	return v;
+}
+
+/*
+ * Allocates the value described by the record at `*r`, without filling
+ * in anything it refers to, and moves `*r` past the record.
+ */
+
+static struct value *
+load_value(struct value *env,
+           const uint64_t **r,
+           const uint64_t *end,
+           location delta)
+{
+	const uint64_t *p = *r;
+	if (p >= end) return NULL;
+
+	unsigned type = p[0] & 0xffffffff;
+	location loc = p[0] >> 32;
+	if (loc > BUILTIN) loc += delta;
+	struct value *v = NULL;
+	size_t n = p + 1 < end ? p[1] : 0;
+
+	switch (type) {
+	case VAL_CELL:
+		v = new_value(type, loc);
+		p += 3;
+		break;
+	case VAL_STRING:
+		v = new_value(type, loc);
+		v->s = kdgu_news((const char *)(p + 2));
+		p += 2 + WORDS(n);
+		break;
+	case VAL_SYMBOL:
+		v = intern(loc, (const char *)(p + 2), n);
+		p += 2 + WORDS(n);
+		break;
+	case VAL_BUILTIN: {
+		struct value *sym = make_symbol(BUILTIN, (const char *)(p + 2));
+		struct value **bind = find(env, sym);
+		if (!bind || TYPE(*bind) != VAL_BUILTIN) return NULL;
+		v = *bind;
+		p += 2 + WORDS(n);
+	} break;
+	case VAL_FUNCTION:
+	case VAL_MACRO:
+		v = new_value(type, loc);
+		p += 4;
+		break;
+	case VAL_ENV:
+		v = gc_alloc(sizeof *v + n * sizeof *v->slot);
+		v->loc = loc;
+		stats.value[VAL_ENV]++;
+		v->num_slot = n;
+		p += 5 + n;
+		break;
+	case VAL_ARRAY:
+		v = new_array(loc, n);
+		p += 2 + n;
+		break;
+	case VAL_ROPE:
+		v = new_value(type, loc);
+		p += 4;
+		break;
+	case VAL_SEQ:
+		if (n > SEQ_TAKE) return NULL;
+		v = new_value(type, loc);
+		v->kind = n;
+		p += 5;
+		break;
+	case VAL_HASH:
+		if (n > (size_t)(end - p) / 2) return NULL;
+		v = new_hash(loc, n);
+		p += 2 + 2 * n;
+		break;
+	case VAL_LOCAL:
+		v = new_value(type, loc);
+		p += 3;
+		break;
+	case VAL_REGEX:
+		if (p + 2 + WORDS(n) >= end) return NULL;
+		if (!(v = load_regex(p, n, loc))) return NULL;
+		p += 3 + WORDS(n);
+		break;
+	case VAL_ERROR:
+	case VAL_NOTE:
+		v = new_value(type, loc);
+		v->errmsg = strdup((const char *)(p + 2));
+		p += 3 + WORDS(n);
+		break;
+	default:
+		return NULL;
+	}
+
+	if (p > end) return NULL;
+
+	v->type = type;
+	*r = p;
+
+	return v;
+}
+
+/*
+ * Fills in what the value `v`, described by the record at `p`, refers
+ * to. Nothing's allocated here.
+ */
+
+static bool
+link_value(struct value *env, struct value *v, const uint64_t *p)
+{
+	bool ok = true;
+
+	switch (v->type) {
+	case VAL_CELL:
+		v->car = deref(p[1], env, &ok);
+		v->cdr = deref(p[2], env, &ok);
+		break;
+	case VAL_FUNCTION:
+	case VAL_MACRO:
+		v->param = deref(p[1], env, &ok);
+		v->body = deref(p[2], env, &ok);
+		v->env = deref(p[3], env, &ok);
+		break;
+	case VAL_ENV:
+		v->vars = deref(p[2], env, &ok);
+		v->up = deref(p[3], env, &ok);
+		v->names = deref(p[4], env, &ok);
+		for (unsigned i = 0; i < v->num_slot; i++)
+			v->slot[i] = deref(p[5 + i], env, &ok);
+		break;
+	case VAL_ARRAY:
+		for (unsigned i = 0; i < v->num; i++)
+			v->arr[i] = deref(p[2 + i], env, &ok);
+		break;
+	case VAL_SEQ:
+		v->source = deref(p[2], env, &ok);
+		v->proc = deref(p[3], env, &ok);
+		v->state = deref(p[4], env, &ok);
+		if (!ok) break;
+		if (v->kind == SEQ_RANGE)
+			ok = IS_INT(v->source) && IS_INT(v->state);
+		if (v->kind == SEQ_TAKE)
+			ok = IS_INT(v->state);
+		if (v->kind == SEQ_ARRAY)
+			ok = TYPE(v->source) == VAL_ARRAY && IS_INT(v->state);
+		if (v->kind >= SEQ_MAP)
+			ok = ok && TYPE(v->source) == VAL_SEQ;
+		break;
+	case VAL_ROPE:
+		v->left = deref(p[1], env, &ok);
+		v->right = deref(p[2], env, &ok);
+		v->length = p[3] & 0xffffffff;
+		v->height = p[3] >> 32;
+		if (ok && (!IS_TEXT(v->left) || !IS_TEXT(v->right)))
+			ok = false;
+		break;
+	case VAL_HASH:
+		for (size_t i = 0; ok && i < p[1]; i++) {
+			struct value *key = deref(p[2 + 2 * i], env, &ok);
+			if (!ok || !hashable(key)) return false;
+			hash_put(v, key, deref(p[3 + 2 * i], env, &ok));
+		}
+		break;
+	case VAL_LOCAL:
+		v->name = deref(p[1], env, &ok);
+		v->depth = p[2] & 0xffffffff;
+		v->index = p[2] >> 32;
+		break;
+	case VAL_ERROR:
+	case VAL_NOTE:
+		v->cdr = deref(p[2 + WORDS(p[1])], env, &ok);
+		break;
+	default:;
+	}
+
+	return ok;
+}
+
+/*
+ * Checks that the `n` sources at `r` are all there and returns how many
+ * locations they take up between them, counting at least one, or 0 if
+ * they aren't.
+ */
+
+static uint64_t
+check_sources(const uint64_t *r, const uint64_t *end, uint64_t n)
+{
+	uint64_t size = 0;
+
+	for (uint64_t i = 0; i < n; i++) {
+		if (r + 1 > end) return 0;
+		r += 1 + WORDS(r[0]);
+		if (r + 1 > end) return 0;
+		size += r[0] + 1;
+		r += 1 + WORDS(r[0]);
+		if (r > end || size > UINT32_MAX) return 0;
+	}
+
+	return size ? size : 1;
+}
+
+/*
+ * The images that have been loaded, so that one that hasn't changed
+ * since can be loaded again from where it's already mapped, with its
+ * sources where they already are.
+ */
+
+static struct mapping {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	const uint64_t *w;
+	location base;
+} *mapping;
+
+static size_t num_mapping;
+
+static struct mapping *
+find_mapping(const struct stat *st)
+{
+	for (size_t i = 0; i < num_mapping; i++) {
+		struct mapping *m = &mapping[i];
+		if (m->dev == st->st_dev && m->ino == st->st_ino
+		 && m->size == st->st_size
+		 && m->mtime.tv_sec == st->st_mtim.tv_sec
+		 && m->mtime.tv_nsec == st->st_mtim.tv_nsec)
+			return m;
+	}
+
+	return NULL;
+}
+
+static void
+add_mapping(const struct stat *st, const uint64_t *w, location base)
+{
+	struct mapping *m = realloc(mapping,
+	                            (num_mapping + 1) * sizeof *mapping);
+	if (!m) return;
+	mapping = m;
+	mapping[num_mapping++] = (struct mapping){
+		st->st_dev, st->st_ino, st->st_size, st->st_mtim, w, base
+	};
+}
+
+/*
+ * Loads the image at `path` into the global environment `env`. If
+ * `extra` isn't NULL it receives the value that the image holds, or
+ * nil if it holds bindings. The image is mapped rather than read and,
+ * if it loads, stays mapped for good, since the source text in it is
+ * used for error messages. Loading it again before it's changed uses
+ * the same mapping.
+ */
+
+bool
+load_image(const char *path, struct value *env, struct value **extra)
+{
+	static bool rooted = false;
+	if (!rooted) gc_roots(walk_loaded), rooted = true;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	const uint64_t *w = MAP_FAILED;
+	struct mapping *m = NULL;
+
+	if (!fstat(fd, &st) && st.st_size >= 48) {
+		m = find_mapping(&st);
+		w = m ? m->w : mmap(NULL, st.st_size, PROT_READ,
+		                     MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (w == MAP_FAILED) return false;
+
+	const uint64_t *end = w + st.st_size / 8, *r = w + w[5];
+	bool ok = w[0] == MAGIC && w[5] <= (uint64_t)(end - w);
+
+	/*
+	 * The sources aren't added until everything else has been checked,
+	 * since the image can't be unmapped once they have been. They'll
+	 * go one after another, just as they were saved, from the first
+	 * place that there's room for all of them. An image that's already
+	 * been loaded has its sources in already.
+	 */
+
+	uint64_t size = m || !ok ? 0 : check_sources(r, end, w[1]);
+	location base = m ? m->base : size ? find_room(size) : NOWHERE;
+
+	if (!base) {
+		munmap((void *)w, st.st_size);
+		return false;
+	}
+
+	location delta = base - (BUILTIN + 1);
+	PROTECT(&env);
+	const uint64_t **rec = malloc(w[2] * sizeof *rec);
+	loaded = malloc(w[2] * sizeof *loaded);
+	num_loaded = 0;
+	r = w + 6;
+
+	for (uint64_t i = 0; ok && i < w[2]; i++) {
+		rec[i] = r;
+		struct value *v = load_value(env, &r, end, delta);
+		if (!v) ok = false;
+		else loaded[num_loaded++] = v;
+	}
+
+	for (size_t i = 0; ok && i < num_loaded; i++)
+		ok = link_value(env, loaded[i], rec[i]);
+
+	const uint64_t *b = r;
+	if (w[3] > (uint64_t)(end - b) / 2) ok = false;
+
+	for (uint64_t i = 0; ok && i < w[3]; i++) {
+		struct value *sym = deref(b[2 * i], env, &ok);
+		if (ok && TYPE(sym) != VAL_SYMBOL) ok = false;
+		deref(b[2 * i + 1], env, &ok);
+	}
+
+	if (ok) deref(w[4], env, &ok);
+
+	if (ok && !m) {
+		r = w + w[5];
+		add_mapping(&st, w, base);
+		location at = base;
+
+		for (uint64_t i = 0; i < w[1]; i++) {
+			const char *file = (const char *)(r + 1);
+			r += 1 + WORDS(r[0]);
+			add_source_at(at, file, (const char *)(r + 1), r[0]);
+			at += r[0] + 1;
+			r += 1 + WORDS(r[0]);
+		}
+	}
+
+	if (ok) {
+		for (uint64_t i = 0; i < w[3]; i++)
+			add_variable(env, deref(b[2 * i], env, &ok),
+			             deref(b[2 * i + 1], env, &ok));
+
+		if (extra) {
+			*extra = deref(w[4], env, &ok);
+			if (!*extra) *extra = Nil;
+		}
+	} else if (!m) munmap((void *)w, st.st_size);
+
+	free(rec);
+	free(loaded);
+	loaded = NULL;
+	num_loaded = 0;
+
+	return ok;
+}
@@ -0,0 +1,10 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include "lisp.h"
+
+bool save_image(const char *path, struct value *env, struct value *extra);
+bool load_image(const char *path, struct value *env, struct value **extra);
+
+#endif
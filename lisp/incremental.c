@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "gc.h"
+#include "eval.h"
+#include "vm.h"
+#include "image.h"
+#include "incremental.h"
+#include "lisp.h"
+
+/*
+ * Incremental evaluation. What each top-level form did is remembered
+ * from one run to the next: what it printed, which global bindings it
+ * looked at, and what it left in the ones that it changed. A form
+ * whose text is the same as last time and that doesn't look at any
+ * binding changed by a form that has been run this time is skipped;
+ * what it printed is printed again, and what it left in its bindings
+ * is put back.
+ *
+ * This assumes that forms only affect each other through the global
+ * bindings, and that a form does the same thing every time it's run
+ * with the same bindings. Values that can be changed in place break
+ * the first assumption, so forms that come across them are always run.
+ *
+ * The record of a form is the list
+ *
+ *   (hash output touched changed)
+ *
+ * where `touched` is a list of symbols and `changed` an alist of what
+ * they were left holding. The records are kept between runs in an
+ * image, see image.c.
+ */
+
+bool tracking;
+
+static struct value *old;     /* Records from the last run, in order. */
+static struct value *done;    /* Records from this run, in reverse.   */
+static struct value *changed; /* Symbols changed by forms we've run.  */
+
+/*
+ * The global binding cells touched by the running form, each followed
+ * by what it held beforehand, or NULL if it's new. `seen` is a hash of
+ * their indices, keyed by the symbols' hashes.
+ */
+
+static struct value **touched;
+static unsigned num_touched, cap_touched;
+static unsigned *seen, cap_seen;
+
+static void
+walk_incremental(gc_visitor *visit)
+{
+	visit(&old);
+	visit(&done);
+	visit(&changed);
+
+	for (unsigned i = 0; i < 2 * num_touched; i++)
+		visit(&touched[i]);
+}
+
+static void
+insert_seen(unsigned n)
+{
+	unsigned mask = cap_seen - 1;
+	unsigned i = touched[2 * (n - 1)]->car->hash & mask;
+	while (seen[i]) i = (i + 1) & mask;
+	seen[i] = n;
+}
+
+/*
+ * Called with each global binding cell that's found or added while
+ * `tracking` is set.
+ */
+
+void
+track_global(struct value *cell, bool added)
+{
+	if (2 * (num_touched + 1) > cap_seen) {
+		free(seen);
+		cap_seen = cap_seen ? cap_seen * 2 : 64;
+		seen = calloc(cap_seen, sizeof *seen);
+		for (unsigned n = 1; n <= num_touched; n++) insert_seen(n);
+	}
+
+	unsigned mask = cap_seen - 1, i = cell->car->hash & mask;
+
+	for (; seen[i]; i = (i + 1) & mask)
+		if (touched[2 * (seen[i] - 1)] == cell) return;
+
+	if (num_touched == cap_touched) {
+		cap_touched = cap_touched ? cap_touched * 2 : 32;
+		touched = realloc(touched,
+		                  2 * cap_touched * sizeof *touched);
+	}
+
+	touched[2 * num_touched] = cell;
+	touched[2 * num_touched + 1] = added ? NULL : cell->cdr;
+	seen[i] = ++num_touched;
+}
+
+static intptr_t
+hash_source(const char *s, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 1099511628211ULL;
+	}
+
+	return h >> 2;
+}
+
+static bool
+memq(struct value *list, struct value *v)
+{
+	for (; TYPE(list) == VAL_CELL; list = list->cdr)
+		if (list->car == v) return true;
+	return false;
+}
+
+static void
+mark_changed(struct value *sym)
+{
+	if (!memq(changed, sym)) changed = cons(sym, changed);
+}
+
+/*
+ * Whether anything that can be changed without changing a binding can
+ * be got at from `v`: an array, a hash table, a sequence, or a frame
+ * that a function closes over. Such a value might be changed by a form
+ * that doesn't look like it changed anything, and what's saved of it
+ * in the record is what it ended up as, not what the form left.
+ */
+
+static bool
+reaches_mutable(struct value *env, struct value *v)
+{
+	for (; v && TYPE(v) == VAL_CELL; v = v->cdr)
+		if (reaches_mutable(env, v->car)) return true;
+
+	if (!v) return false;
+
+	switch (TYPE(v)) {
+	case VAL_ARRAY: case VAL_HASH: case VAL_SEQ: case VAL_ENV:
+		return true;
+	case VAL_FUNCTION: case VAL_MACRO:
+		return v->env != env;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Notes that whatever the form recorded in `rec` changed might not be
+ * changed this time.
+ */
+
+static void
+forget(struct value *rec)
+{
+	for (struct value *p = rec->cdr->cdr->cdr->car;
+	     TYPE(p) == VAL_CELL;
+	     p = p->cdr) {
+		PROTECT(&p);
+		mark_changed(p->car->car);
+	}
+}
+
+/*
+ * Whether the form recorded in `rec` looked at anything that's been
+ * changed this time around.
+ */
+
+static bool
+stale(struct value *rec)
+{
+	for (struct value *p = rec->cdr->cdr->car;
+	     TYPE(p) == VAL_CELL;
+	     p = p->cdr)
+		if (memq(changed, p->car)) return true;
+	return false;
+}
+
+static struct value *
+replay(struct value *env, struct value *rec)
+{
+	struct value *p = rec->cdr->cdr->cdr->car;
+	PROTECT(&env, &rec, &p);
+
+	kdgu_print(rec->cdr->car->s, output);
+
+	for (; TYPE(p) == VAL_CELL; p = p->cdr) {
+		struct value **bind = find(env, p->car->car);
+		if (bind) assign(bind, p->car->cdr);
+		else add_variable(env, p->car->car, p->car->cdr);
+	}
+
+	done = cons(rec, done);
+
+	return Nil;
+}
+
+/*
+ * Makes the record of a form that's just been run in `env` from what
+ * it touched, and notes what it changed. Anything it touched that can
+ * be changed in place counts as changed, and the record won't match
+ * next time. The record's own cells aren't from anywhere, so that
+ * they don't keep the source that the symbols were first seen in.
+ */
+
+static struct value *
+record(struct value *env, intptr_t hash, const char *out)
+{
+	struct value *text = NULL, *sym = NULL, *list = Nil, *alist = Nil;
+	PROTECT(&env, &text, &sym, &list, &alist);
+
+	text = new_value(VAL_STRING, NOWHERE);
+	text->s = kdgu_news(out);
+
+	for (unsigned i = 0; i < num_touched; i++) {
+		struct value *cell = touched[2 * i];
+		sym = cell->car;
+		list = cons(sym, list);
+		list->loc = NOWHERE;
+
+		cell = touched[2 * i];
+		bool in_place = reaches_mutable(env, touched[2 * i + 1])
+		             || reaches_mutable(env, cell->cdr);
+
+		if (in_place) hash = -1;
+		else if (touched[2 * i + 1] == cell->cdr) continue;
+
+		alist = acons(sym, cell->cdr, alist);
+		alist->loc = alist->car->loc = NOWHERE;
+		mark_changed(sym);
+	}
+
+	struct value *r = cons(alist, Nil);
+	r = cons(list, r);
+	r = cons(text, r);
+	return cons(MAKE_INT(hash), r);
+}
+
+/*
+ * Evaluates the top-level form `form`, whose source is the `len`
+ * bytes at `src`, unless it can be skipped.
+ */
+
+struct value *
+eval_incremental(struct value *env,
+                 struct value *form,
+                 const char *src,
+                 size_t len)
+{
+	struct value *rec = Nil, *r = NULL;
+	PROTECT(&env, &form, &rec, &r);
+	intptr_t hash = hash_source(src, len);
+
+	/*
+	 * A form's record is the first one left with the same text, so that
+	 * adding a form doesn't throw off the ones after it. The records
+	 * that are passed over are of forms that have been changed or taken
+	 * away.
+	 */
+
+	size_t skip = 0;
+	struct value *p = old;
+
+	while (TYPE(p) == VAL_CELL && INT(p->car->car) != hash)
+		p = p->cdr, skip++;
+
+	if (TYPE(p) == VAL_CELL) {
+		for (; skip; skip--, old = old->cdr) forget(old->car);
+		rec = old->car, old = old->cdr;
+	}
+
+	if (TYPE(rec) == VAL_CELL && !stale(rec))
+		return replay(env, rec);
+
+	/* Whatever it changed last time might not be changed now. */
+
+	if (TYPE(rec) == VAL_CELL) forget(rec);
+
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *saved = output;
+
+	output = open_memstream(&buf, &size);
+	num_touched = 0;
+	if (seen) memset(seen, 0, cap_seen * sizeof *seen);
+	tracking = true;
+
+	r = use_vm ? vm_eval(env, form) : eval(env, form);
+
+	tracking = false;
+	fclose(output);
+	output = saved;
+	fwrite(buf, 1, size, output);
+
+	/* Forms that fail are run again next time. */
+
+	rec = record(env, r && TYPE(r) == VAL_ERROR ? -1 : hash, buf);
+	done = cons(rec, done);
+	num_touched = 0;
+	free(buf);
+
+	return r;
+}
+
+/*
+ * Starts incremental evaluation in `env` with the records kept in
+ * `path`, if it's given and there are any, and otherwise from scratch.
+ * This has to be done before any source is loaded.
+ */
+
+void
+start_incremental(const char *path, struct value *env)
+{
+	static bool rooted;
+	if (!rooted) gc_roots(walk_incremental), rooted = true;
+
+	old = done = changed = Nil;
+
+	struct value *r;
+	if (path && load_image(path, env, &r)) old = r;
+}
+
+/*
+ * Finishes a run. Its records are what the next run in the same
+ * environment is checked against, and are saved to `path` if it's
+ * given.
+ */
+
+bool
+finish_incremental(const char *path, struct value *env)
+{
+	old = Nil;
+	changed = Nil;
+
+	while (TYPE(done) == VAL_CELL) {
+		struct value *next = done->cdr;
+		done->cdr = old;
+		old = done;
+		done = next;
+	}
+
+	return !path || save_image(path, env, old);
+}
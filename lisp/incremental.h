@@ -0,0 +1,18 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include <stdbool.h>
+#include "lisp.h"
+
+extern bool tracking;
+
+void track_global(struct value *cell, bool added);
+
+void start_incremental(const char *path, struct value *env);
+struct value *eval_incremental(struct value *env,
+                               struct value *form,
+                               const char *src,
+                               size_t len);
+bool finish_incremental(const char *path, struct value *env);
+
+#endif
@@ -20,36 +20,40 @@ struct token {
 		TOK_INT,
 		TOK_STR,
 		TOK_IDENT,
+		TOK_TEXT,
 		TOK_EOF
 	} type;
 
-	char *body;            /* Region of input this is from.     */
-	struct location loc;   /* Location in source code.          */
-
 	/*
-	 * Identifiers don't have their own data field because their
-	 * fields would be identical to their bodies.
+	 * Tokens are passed around by value and point straight into
+	 * the input; the body is `len` bytes long and isn't
+	 * terminated. String contents are only decoded if the parser
+	 * asks for them with `token_string()`.
 	 */
 
-	union {
-		kdgu *s;       /* String contents.                  */
-		int i;         /* Integer.                          */
-	};
+	const char *body;      /* Region of input this is from.     */
+	unsigned len;          /* Length of the body.               */
+	location loc;          /* Location in source code.          */
+	long long i;           /* Integer.                          */
 };
 
 struct lexer {
 	const char *file;      /* Filename.                         */
-	struct location loc;   /* Current input location.           */
 	const char *s;         /* Input stream.                     */
 	const char *e;         /* End of input stream.              */
+	size_t idx;            /* Current position in the input.    */
+	location base;         /* Location of the first character.  */
 };
 
 enum mode {
 	TALK, CODE
 };
 
-struct lexer *new_lexer(const char *file, const char *s);
-struct token *tok(struct lexer *l, enum mode mode);
-void print_token(FILE *f, struct token *t);
+struct lexer *new_lexer(const char *file, const char *s, size_t len);
+void free_lexer(struct lexer *l);
+struct token tok(struct lexer *l, enum mode mode);
+kdgu *token_string(const struct token *t);
+unsigned token_length(const char *s, const char *e);
+void print_token(FILE *f, const struct token *t);
 
 #endif
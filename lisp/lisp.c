@@ -3,9 +3,15 @@
 #include <assert.h>
 
 #include "error.h"
+#include "gc.h"
 #include "builtin.h"
 #include "lisp.h"
 #include "eval.h"
+#include "incremental.h"
+#include "profile.h"
+#include "stats.h"
+#include "hash.h"
+#include "rope.h"
 
 const char **value_name = (const char *[]){
 	"int",
@@ -17,6 +23,11 @@ const char **value_name = (const char *[]){
 	"macro",
 	"env",
 	"array",
+	"local",
+	"regex",
+	"hash",
+	"rope",
+	"seq",
 	"moved",
 	"true",
 	"nil",
@@ -25,76 +36,113 @@ const char **value_name = (const char *[]){
 	"error",
 };
 
-struct value *Dot = &(struct value){VAL_DOT,{0},0};
-struct value *RParen = &(struct value){VAL_RPAREN,{0},0};
-struct value *Nil = &(struct value){VAL_NIL,{0},0};
-struct value *True = &(struct value){VAL_TRUE,{0},0};
+struct value *Dot = &(struct value){VAL_DOT,0,{{0}}};
+struct value *RParen = &(struct value){VAL_RPAREN,0,{{0}}};
+struct value *Nil = &(struct value){VAL_NIL,0,{{0}}};
+struct value *True = &(struct value){VAL_TRUE,0,{{0}}};
+
+/*
+ * Bumped whenever a binding that holds a macro, or is about to,
+ * changes; this invalidates every cached macro expansion.
+ */
+
+unsigned macro_epoch;
+
+/* Where `print` and `println` write to. */
+FILE *output;
 
 struct value *
-new_value(struct location *loc)
+new_value(int type, location loc)
 {
-	struct value *v = malloc(sizeof *v);
-	memset(v, 0, sizeof *v);
+	struct value *v = gc_alloc(sizeof *v);
+	v->type = type;
 	v->loc = loc;
+	stats.value[type]++;
 	return v;
 }
 
 struct value *
 quote(struct value *v)
 {
-	return cons(make_symbol(v->loc, "quote"), cons(v, Nil));
+	PROTECT(&v);
+	struct value *sym = make_symbol(LOC(v), "quote");
+	PROTECT(&sym);
+	struct value *tail = cons(v, Nil);
+	return cons(sym, tail);
 }
 
 struct value *
 list_length(struct value *list)
 {
-	int len = 0;
+	intptr_t len = 0;
+	location loc = LOC(list);
 
-	while (list->type != VAL_NIL) {
-		if (list->type == VAL_CELL) {
+	while (TYPE(list) != VAL_NIL) {
+		if (TYPE(list) == VAL_CELL) {
+			loc = list->loc;
 			list = list->cdr;
 			len++;
 			continue;
 		}
 
-		return error(list->loc,
+		/* Integers don't know where they are; blame the cell. */
+
+		return error(IS_INT(list) ? loc : list->loc,
 		             "a non-dotted list was expected here");
 	}
 
-	struct value *r = new_value(list->loc);
-
-	r->type = VAL_INT;
-	r->i = len;
-
-	return r;
+	return MAKE_INT(len);
 }
 
 struct value *
 print_value(FILE *f, struct value *v)
 {
-	switch (v->type) {
+	switch (TYPE(v)) {
 	case VAL_SYMBOL:
 	case VAL_STRING: kdgu_print(v->s, f);    break;
-	case VAL_INT:    fprintf(f, "%d", v->i); break;
+	case VAL_LOCAL:  kdgu_print(v->name->s, f); break;
+	case VAL_INT:    fprintf(f, "%lld", (long long)INT(v)); break;
 	case VAL_TRUE:   fprintf(f, "true");     break;
 	case VAL_NIL:    fprintf(f, "nil");      break;
 	case VAL_FUNCTION:
 		fprintf(f, "<function:%p>", v);
 		break;
+	case VAL_ROPE:   print_rope(f, v);       break;
+	case VAL_SEQ:    fputs("<seq>", f);      break;
+	case VAL_REGEX:
+		fputs("<regex:", f);
+		kdgu_print(v->pattern, f);
+		fputc('>', f);
+		break;
 	case VAL_ARRAY:
 		for (unsigned i = 0; i < v->num; i++)
 			print_value(f, v->arr[i]);
 		break;
+	case VAL_HASH: {
+		bool first = true;
+		fputc('{', f);
+
+		for (unsigned i = 0; i < v->cap_slot; i++) {
+			if (!v->slots[i].key) continue;
+			if (!first) fputs(", ", f);
+			print_value(f, v->slots[i].key);
+			fputc(' ', f);
+			print_value(f, v->slots[i].val);
+			first = false;
+		}
+
+		fputc('}', f);
+	} break;
 	case VAL_CELL:
 		fputc('(', f);
 
-		while (v->type == VAL_CELL) {
+		while (TYPE(v) == VAL_CELL) {
 			print_value(f, v->car);
-			if (v->cdr->type == VAL_CELL) fputc(' ', f);
+			if (TYPE(v->cdr) == VAL_CELL) fputc(' ', f);
 			v = v->cdr;
 		}
 
-		if (v->type != VAL_NIL)
+		if (TYPE(v) != VAL_NIL)
 			fputc(' ', f), print_value(f, v);
 
 		fputc(')', f);
@@ -103,7 +151,7 @@ print_value(FILE *f, struct value *v)
 		return error(v->loc,
 		             "bug: unimplemented printer for"
 		             " expression of type `%s'",
-		             TYPE_NAME(v->type));
+		             TYPE_NAME(TYPE(v)));
 	}
 
 	return Nil;
@@ -112,8 +160,8 @@ print_value(FILE *f, struct value *v)
 struct value *
 cons(struct value *car, struct value *cdr)
 {
-	struct value *v = new_value(car->loc);
-	v->type = VAL_CELL;
+	PROTECT(&car, &cdr);
+	struct value *v = new_value(VAL_CELL, LOC(car));
 	v->car = car;
 	v->cdr = cdr;
 	return v;
@@ -122,114 +170,697 @@ cons(struct value *car, struct value *cdr)
 struct value *
 acons(struct value *x, struct value *y, struct value *a)
 {
-	return cons(cons(x, y), a);
+	PROTECT(&a);
+	struct value *c = cons(x, y);
+	return cons(c, a);
+}
+
+/*
+ * Strings are indexed by character, which in a variable-width
+ * encoding means walking from the start. The first time a string is
+ * indexed into it's walked once, and where every `STRING_CRUMB`th
+ * character starts is kept so that finding any other takes at most
+ * that many steps from there. Strings can't be changed, so this is
+ * good for as long as the string's around. A UTF-8 string that's all
+ * ASCII needs no walking at all.
+ */
+
+#define STRING_CRUMB 64
+
+/*
+ * Whether all of the `len` bytes at `s` are ASCII. It's done a word at
+ * a time, which compilers turn into vector instructions where there
+ * are any.
+ */
+
+static bool
+all_ascii(const char *s, size_t len)
+{
+	uint64_t acc = 0;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, s + i, 8);
+		acc |= w;
+	}
+
+	for (; i < len; i++) acc |= (unsigned char)s[i];
+
+	return !(acc & 0x8080808080808080ULL);
+}
+
+static void
+index_string(struct value *str)
+{
+	kdgu *k = str->s;
+	if (!k->len) return;
+
+	if (k->fmt == KDGU_FMT_UTF8 && all_ascii(k->s, k->len)) {
+		str->num_char = k->len;
+		return;
+	}
+
+	unsigned idx = 0, n = 0, cap = 16;
+	unsigned *crumb = malloc(cap * sizeof *crumb);
+
+	while (idx < k->len) {
+		if (n % STRING_CRUMB == 0) {
+			if (n / STRING_CRUMB == cap)
+				crumb = realloc(crumb, (cap *= 2) * sizeof *crumb);
+			crumb[n / STRING_CRUMB] = idx;
+		}
+
+		n++;
+		if (!kdgu_next(k, &idx)) break;
+	}
+
+	/* Every character's a byte in a single-byte encoding. */
+
+	if (n == k->len) {
+		free(crumb);
+		crumb = NULL;
+	}
+
+	str->crumb = crumb;
+	str->num_char = n;
+}
+
+/*
+ * Returns the number of characters in the string `str`.
+ */
+
+unsigned
+string_length(struct value *str)
+{
+	if (!str->num_char) index_string(str);
+	return str->num_char;
+}
+
+/*
+ * Returns where the `i`th character of the string `str` starts, or
+ * its length if `i` is its number of characters.
+ */
+
+unsigned
+string_offset(struct value *str, unsigned i)
+{
+	if (i >= string_length(str)) return str->s->len;
+	if (!str->crumb) return i;
+
+	unsigned idx = str->crumb[i / STRING_CRUMB];
+
+	for (unsigned j = i % STRING_CRUMB; j; j--)
+		kdgu_next(str->s, &idx);
+
+	return idx;
 }
 
+/*
+ * Makes an array of `num` elements, all of them NULL.
+ */
+
 struct value *
-make_symbol(struct location *loc, const char *s)
+new_array(location loc, unsigned num)
 {
-	if (!strcmp(s, "nil")) return Nil;
-	if (!strcmp(s, "t")) return True;
+	struct value *v = new_value(VAL_ARRAY, loc);
+	v->arr = calloc(num ? num : 1, sizeof *v->arr);
+	v->num = v->cap = num;
+	return v;
+}
+
+/*
+ * Appends `v` to the array `arr`, doubling its storage when it runs
+ * out so that a run of pushes takes amortized constant time.
+ */
+
+void
+array_push(struct value *arr, struct value *v)
+{
+	if (arr->num == arr->cap) {
+		arr->cap = arr->cap ? arr->cap * 2 : 8;
+		arr->arr = realloc(arr->arr, arr->cap * sizeof *arr->arr);
+	}
+
+	arr->arr[arr->num++] = v;
+}
+
+/*
+ * The symbol table. Every distinct name is interned exactly once, so
+ * two symbols are the same symbol if and only if they're the same
+ * pointer. It's an open-addressed table keyed on the bytes of the
+ * name; the hashes are kept alongside so that growing it doesn't
+ * need to rehash any strings.
+ */
+
+struct symslot {
+	unsigned hash;
+	struct value *sym;
+};
+
+static struct {
+	struct symslot *slot;
+	unsigned num, cap;
+} symtab;
+
+unsigned
+hash_bytes(const char *s, size_t len)
+{
+	unsigned h = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static void
+walk_symbols(gc_visitor *visit)
+{
+	for (unsigned i = 0; i < symtab.cap; i++)
+		if (symtab.slot[i].sym) visit(&symtab.slot[i].sym);
+}
+
+static void
+grow_symtab(void)
+{
+	unsigned cap = symtab.cap ? symtab.cap * 2 : 256;
+	struct symslot *slot = calloc(cap, sizeof *slot);
+
+	if (!symtab.cap) gc_roots(walk_symbols);
+
+	for (unsigned i = 0; i < symtab.cap; i++) {
+		if (!symtab.slot[i].sym) continue;
+		unsigned j = symtab.slot[i].hash & (cap - 1);
+		while (slot[j].sym) j = (j + 1) & (cap - 1);
+		slot[j] = symtab.slot[i];
+	}
+
+	free(symtab.slot);
+	symtab.slot = slot;
+	symtab.cap = cap;
+}
+
+/*
+ * Interns the `len` bytes at `s`, which don't have to be terminated;
+ * the parser hands us slices of the source text.
+ */
+
+struct value *
+intern(location loc, const char *s, size_t len)
+{
+	if (len == 3 && !memcmp(s, "nil", 3)) return Nil;
+	if (len == 1 && *s == 't') return True;
+
+	unsigned hash = hash_bytes(s, len);
+
+	if (symtab.num * 2 >= symtab.cap) grow_symtab();
+
+	unsigned i = hash & (symtab.cap - 1);
+
+	for (; symtab.slot[i].sym; i = (i + 1) & (symtab.cap - 1)) {
+		struct value *sym = symtab.slot[i].sym;
+		if (symtab.slot[i].hash == hash
+		    && sym->s->len == len
+		    && !memcmp(sym->s->s, s, len))
+			return sym;
+	}
+
+	/*
+	 * Collections don't rehash the table, so slot `i` is still
+	 * ours after the allocation.
+	 */
+
+	struct value *sym = new_value(VAL_SYMBOL, loc);
+	sym->hash = hash;
+	sym->global = sym->global_env = NULL;
+
+	char *name = malloc(len + 1);
+	memcpy(name, s, len);
+	name[len] = 0;
+	sym->s = kdgu_news(name);
+	free(name);
+
+	symtab.slot[i].hash = hash;
+	symtab.slot[i].sym = sym;
+	symtab.num++;
 
-	struct value *sym = new_value(loc);
-	sym->type = VAL_SYMBOL;
-	sym->s = kdgu_news(s);
 	return sym;
 }
 
+struct value *
+make_symbol(location loc, const char *s)
+{
+	return intern(loc, s, strlen(s));
+}
+
+/*
+ * Forgets where the symbols first seen in [`lo`, `hi`) were seen, for
+ * when that source is taken back. Symbols are kept for good, so they
+ * can't be what keeps a source around.
+ */
+
+void
+unlocate_symbols(location lo, location hi)
+{
+	for (unsigned i = 0; i < symtab.cap; i++) {
+		struct value *sym = symtab.slot[i].sym;
+		if (sym && sym->loc >= lo && sym->loc < hi) sym->loc = NOWHERE;
+	}
+}
+
+/*
+ * Returns the expansion of the form `v` if it's a macro call, or `v`
+ * itself if it isn't. The result is remembered in the cell until a
+ * macro binding changes, so a form that's evaluated over and over
+ * (say in the body of a loop) is only expanded once. This assumes
+ * that expanding a form gives the same result every time, and that
+ * the head of a form always refers to the same binding.
+ */
+
 struct value *
 expand(struct value *env, struct value *v)
 {
-	if (v->type != VAL_CELL || v->car->type != VAL_SYMBOL)
+	if (TYPE(v) != VAL_CELL || TYPE(v->car) != VAL_SYMBOL)
+		return v;
+
+	stats.expand++;
+
+	if (v->expansion && v->epoch == macro_epoch) {
+		stats.expand_hit++;
+		return v->expansion;
+	}
+
+	struct value **bind = find(env, v->car);
+
+	if (!bind || TYPE(*bind) != VAL_MACRO) {
+		v->expansion = v;
+		v->epoch = macro_epoch;
 		return v;
-	struct value *bind = find(env, v->car);
-	if (!bind || bind->cdr->type != VAL_MACRO) return v;
-	return progn(push_env(env, bind->cdr->param, v->cdr),
-	             bind->cdr->body);
+	}
+
+	struct value *mac = *bind;
+	unsigned epoch = macro_epoch;
+	PROTECT(&mac, &v);
+	PROFILE_MARK(mark);
+	if (profiling) profile_call(mac, false);
+	stats.expansion++;
+	struct value *frame = push_env(env, mac->param, v->cdr);
+	struct value *r = progn(frame, mac->body);
+
+	/*
+	 * Errors aren't cached so that they're reported again, and
+	 * neither is anything expanded while a macro was redefined.
+	 */
+
+	if (TYPE(r) != VAL_ERROR && epoch == macro_epoch) {
+		v->expansion = r;
+		v->epoch = epoch;
+	}
+
+	return r;
+}
+
+/*
+ * Nearly everything is defined in the global environment, so rather
+ * than an association list its `vars` is an open-addressed hash table
+ * of `(sym . value)` cells keyed by the symbols' hashes. It's kept in
+ * an array value so that the collector keeps it and the cells up to
+ * date. Bindings are never removed, so a symbol can hold on to the
+ * cell it was found in for as long as it's asked about the same
+ * environment.
+ */
+
+static struct value **
+find_global(struct value *env, struct value *sym)
+{
+	if (sym->global_env == env) {
+		if (tracking) track_global(sym->global, false);
+		return &sym->global->cdr;
+	}
+
+	struct value *tab = env->vars;
+	if (TYPE(tab) != VAL_ARRAY) return NULL;
+
+	unsigned mask = tab->num - 1;
+
+	for (unsigned i = sym->hash & mask;
+	     tab->arr[i];
+	     i = (i + 1) & mask) {
+		if (tab->arr[i]->car != sym) continue;
+		sym->global = tab->arr[i];
+		sym->global_env = env;
+		if (tracking) track_global(sym->global, false);
+		return &sym->global->cdr;
+	}
+
+	return NULL;
+}
+
+static void
+insert_global(struct value *tab, struct value *cell)
+{
+	unsigned mask = tab->num - 1, i = cell->car->hash & mask;
+	while (tab->arr[i]) i = (i + 1) & mask;
+	tab->arr[i] = cell;
+}
+
+static struct value *
+add_global(struct value *env, struct value *sym, struct value *body)
+{
+	struct value *tab = env->vars;
+	PROTECT(&env, &sym, &body, &tab);
+
+	if (TYPE(tab) != VAL_ARRAY || (env->num_global + 1) * 2 > tab->num) {
+		unsigned cap = TYPE(tab) == VAL_ARRAY ? tab->num * 2 : 64;
+		struct value *n = new_array(NOWHERE, cap);
+
+		if (TYPE(tab) == VAL_ARRAY)
+			for (unsigned i = 0; i < tab->num; i++)
+				if (tab->arr[i]) insert_global(n, tab->arr[i]);
+
+		env->vars = tab = n;
+	}
+
+	struct value *cell = cons(sym, body);
+	cell->loc = NOWHERE;
+	insert_global(tab, cell);
+	env->num_global++;
+	if (tracking) track_global(cell, true);
+
+	return body;
+}
+
+/*
+ * Looks up `sym` in the frame `env` alone and returns a pointer to
+ * the place its value is stored, or NULL.
+ */
+
+static struct value **
+find_local(struct value *env, struct value *sym)
+{
+	if (!env->up) return find_global(env, sym);
+
+	unsigned i = 0;
+	struct value *p = env->names;
+
+	for (; TYPE(p) == VAL_CELL; p = p->cdr, i++) {
+		stats.binding++;
+		if (p->car == sym) return &env->slot[i];
+	}
+
+	/* The rest parameter of a variadic function. */
+	if (p == sym) return &env->slot[i];
+
+	for (struct value *c = env->vars;
+	     TYPE(c) != VAL_NIL;
+	     c = c->cdr) {
+		stats.binding++;
+		if (c->car->car == sym) return &c->car->cdr;
+	}
+
+	return NULL;
 }
 
 /*
  * Looks up `sym` in `env`, moving up into higher lexical scopes as
- * necessary. `sym` is assumed to be a `VAL_SYMBOL`. returns NULL if
- * the symbol could not be resolved.
+ * necessary. `sym` is assumed to be a `VAL_SYMBOL`; since symbols are
+ * interned they're compared by identity. Returns a pointer to the
+ * place the value of the variable is stored, or NULL if the symbol
+ * could not be resolved. The pointer is only good until the next
+ * allocation.
  */
 
-struct value *
+struct value **
 find(struct value *env, struct value *sym)
 {
-	assert(sym->type == VAL_SYMBOL);
+	assert(TYPE(sym) == VAL_SYMBOL);
+	unsigned depth = 0;
+
+	stats.find++;
+
+	for (; env; env = env->up) {
+		struct value **p = find_local(env, sym);
+		if (depth < STATS_FRAMES) depth++;
+		if (!p) continue;
+		stats.frames[depth]++;
+		return p;
+	}
+
+	stats.frames[depth]++;
 
 	/*
 	 * We've walked up through every scope and haven't found the
 	 * symbol. It must not exist.
 	 */
 
-	if (!env) return NULL;
+	return NULL;
+}
 
-	for (struct value *c = env->vars;
-	     c->type != VAL_NIL;
-	     c = c->cdr) {
-		struct value *bind = c->car;
-		if (kdgu_cmp(sym->s, bind->car->s, false, NULL))
-			return bind;
-	}
+/*
+ * Returns a pointer to the slot referred to by the `VAL_LOCAL`
+ * reference `ref`, relative to the frame `env`. The pointer is only
+ * good until the next allocation.
+ */
+
+struct value **
+local(struct value *env, struct value *ref)
+{
+	for (unsigned i = 0; i < ref->depth; i++) env = env->up;
+	return &env->slot[ref->index];
+}
 
-	return find(env->up, sym);
+/*
+ * Stores `v` in the variable `*p`, which came from `find()` or
+ * `local()`.
+ */
+
+struct value *
+assign(struct value **p, struct value *v)
+{
+	if (TYPE(*p) == VAL_MACRO || TYPE(v) == VAL_MACRO)
+		macro_epoch++;
+	return *p = v;
 }
 
+/*
+ * Binds `sym` to `body` in `env`. Rebinding a symbol that's already
+ * bound in `env` itself replaces the old binding rather than
+ * shadowing it.
+ */
+
 struct value *
 add_variable(struct value *env, struct value *sym, struct value *body)
 {
-	env->vars = acons(sym, body, env->vars);
+	struct value **p = find_local(env, sym);
+	if (p) return assign(p, body);
+
+	/* The new binding might hide a macro. */
+
+	p = find(env, sym);
+	if (TYPE(body) == VAL_MACRO || (p && TYPE(*p) == VAL_MACRO))
+		macro_epoch++;
+
+	if (!env->up) return add_global(env, sym, body);
+
+	PROTECT(&env, &body);
+	struct value *vars = acons(sym, body, env->vars);
+	vars->car->loc = NOWHERE;
+	env->vars = vars;
 	return body;
 }
 
+/*
+ * Notes that the binding of `sym` that's seen from `env` was last made
+ * at `loc`, in the `loc` of the cell that holds it. Parameters have no
+ * cell; they were bound where they're declared.
+ */
+
+void
+note_binding(struct value *env, struct value *sym, location loc)
+{
+	for (; env; env = env->up) {
+		if (!env->up) {
+			if (find_global(env, sym)) sym->global->loc = loc;
+			return;
+		}
+
+		struct value *p = env->names;
+
+		for (; TYPE(p) == VAL_CELL; p = p->cdr)
+			if (p->car == sym) return;
+		if (p == sym) return;
+
+		for (struct value *c = env->vars;
+		     TYPE(c) != VAL_NIL;
+		     c = c->cdr)
+			if (c->car->car == sym) {
+				c->car->loc = loc;
+				return;
+			}
+	}
+}
+
+/*
+ * Returns where a binding seen from `env` that holds `v` was last made,
+ * looking in the innermost scopes first, or NOWHERE if there's none.
+ */
+
+location
+find_binding(struct value *env, struct value *v)
+{
+	for (; env; env = env->up) {
+		if (!env->up) {
+			struct value *tab = env->vars;
+			if (TYPE(tab) != VAL_ARRAY) return NOWHERE;
+
+			for (unsigned i = 0; i < tab->num; i++)
+				if (tab->arr[i] && tab->arr[i]->cdr == v)
+					return tab->arr[i]->loc;
+
+			return NOWHERE;
+		}
+
+		struct value *p = env->names;
+		unsigned i = 0;
+
+		for (; TYPE(p) == VAL_CELL; p = p->cdr, i++)
+			if (env->slot[i] == v) return p->loc;
+		if (TYPE(p) == VAL_SYMBOL && env->slot[i] == v)
+			return NOWHERE;
+
+		for (struct value *c = env->vars;
+		     TYPE(c) != VAL_NIL;
+		     c = c->cdr)
+			if (c->car->cdr == v) return c->car->loc;
+	}
+
+	return NOWHERE;
+}
+
 void
 add_builtin(struct value *env, const char *name, builtin *f)
 {
+	PROTECT(&env);
 	struct value *sym = make_symbol(BUILTIN, name);
-	struct value *prim = malloc(sizeof *prim);
-	prim->type = VAL_BUILTIN;
+	PROTECT(&sym);
+	struct value *prim = new_value(VAL_BUILTIN, BUILTIN);
 	prim->prim = f;
+	prim->prim_name = name;
+	add_variable(env, sym, prim);
+}
+
+/*
+ * Like `add_builtin()`, but for builtins that just want the values of
+ * their arguments; see `invoke()`.
+ */
+
+void
+add_native(struct value *env,
+           const char *name,
+           native *f,
+           int min_arg,
+           int max_arg)
+{
+	PROTECT(&env);
+	struct value *sym = make_symbol(BUILTIN, name);
+	PROTECT(&sym);
+	struct value *prim = new_value(VAL_BUILTIN, BUILTIN);
+	prim->fun = f;
+	prim->prim_name = name;
+	prim->min_arg = min_arg;
+	prim->max_arg = max_arg;
 	add_variable(env, sym, prim);
 }
 
 struct value *
 new_environment(void)
 {
-	struct value *env = new_value(NOWHERE);
-	env->vars = Nil;
+	struct value *env = new_frame(NULL, Nil);
+	PROTECT(&env);
 	load_builtins(env);
 	return env;
 }
 
-static struct value *
-make_env(struct value *vars, struct value *up)
+/*
+ * Empties the global environment `env` back out to just the builtins,
+ * as though it had just been made. Functions that were made in it stay
+ * in it, and see whatever it's given from now on.
+ */
+
+void
+reset_environment(struct value *env)
 {
-	struct value *r = malloc(sizeof *r);
-	r->vars = vars;
+	PROTECT(&env);
+
+	/* The symbols would otherwise hang on to the old bindings. */
+
+	for (unsigned i = 0; i < symtab.cap; i++)
+		if (symtab.slot[i].sym)
+			symtab.slot[i].sym->global =
+				symtab.slot[i].sym->global_env = NULL;
+
+	env->vars = Nil;
+	env->num_global = 0;
+	macro_epoch++;
+	load_builtins(env);
+}
+
+/*
+ * Makes a new frame below `up` with one slot for each of the
+ * parameter names in `names`, all initially nil.
+ */
+
+struct value *
+new_frame(struct value *up, struct value *names)
+{
+	unsigned num = 0;
+	struct value *p = names;
+
+	for (; TYPE(p) == VAL_CELL; p = p->cdr) num++;
+	if (TYPE(p) != VAL_NIL) num++;
+
+	PROTECT(&up, &names);
+	struct value *r = gc_alloc(sizeof *r + num * sizeof *r->slot);
+
+	r->type = VAL_ENV;
+	r->loc = NOWHERE;
+	stats.value[VAL_ENV]++;
+	r->vars = Nil;
 	r->up = up;
+	r->names = names;
+	r->num_slot = num;
+	r->num_global = 0;
+
+	for (unsigned i = 0; i < num; i++) r->slot[i] = Nil;
+
 	return r;
 }
 
+/*
+ * Makes a frame binding the parameter list `vars` to the list of
+ * `values` below `env`.
+ */
+
 struct value *
 push_env(struct value *env, struct value *vars, struct value *values)
 {
-	/* if (list_length(vars) != list_length(values)) */
-	/* 	error("Cannot apply function: number of argument does not match"); */
-
-	struct value *map = Nil;
-	struct value *p = vars, *q = values;
+	PROTECT(&values);
+	struct value *frame = new_frame(env, vars);
+	struct value *p = frame->names;
+	unsigned i = 0;
 
 	for (;
-	     p->type == VAL_CELL;
-	     p = p->cdr, q = q->cdr)
-		map = acons(p->car, q->car, map);
+	     TYPE(p) == VAL_CELL && TYPE(values) == VAL_CELL;
+	     p = p->cdr, values = values->cdr)
+		frame->slot[i++] = values->car;
 
-	if (p->type != VAL_NIL)
-		map = acons(p, q, map);
+	if (TYPE(p) == VAL_SYMBOL)
+		frame->slot[frame->num_slot - 1] = values;
 
-	return make_env(map, env);
+	return frame;
 }
 
 #define p(...) printf(__VA_ARGS__)
@@ -250,13 +881,17 @@ print_tree(FILE *f, struct value *v)
 		return;
 	}
 
-	switch (v->type) {
+	switch (TYPE(v)) {
 	case VAL_BUILTIN:
 		p("(builtin:%p)", v->prim);
 		break;
 	case VAL_SYMBOL:
 		p("(symbol:%.*s)", v->s->len, v->s->s);
 		break;
+	case VAL_LOCAL:
+		p("(local:%.*s:%u:%u)", v->name->s->len, v->name->s->s,
+		  v->depth, v->index);
+		break;
 	case VAL_CELL:
 		p("(cell)");
 		l++;
@@ -270,7 +905,7 @@ print_tree(FILE *f, struct value *v)
 		p("\"%.*s\"", v->s->len, v->s->s);
 		break;
 	case VAL_INT:
-		p("(int:%d)", v->i);
+		p("(int:%lld)", (long long)INT(v));
 		break;
 	case VAL_NIL:
 		p("(nil)");
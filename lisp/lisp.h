@@ -2,11 +2,19 @@
 #define LISP_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <kdg/kdgu.h>
 #include "location.h"
 #include "lex.h"
 
+struct code;
+struct hash_slot;
+
 typedef struct value *builtin(struct value *, struct value *);
+typedef struct value *native(struct value *env,
+                             location loc,
+                             unsigned argc,
+                             struct value **argv);
 
 struct value {
 	enum {
@@ -19,6 +27,11 @@ struct value {
 		VAL_MACRO,
 		VAL_ENV,
 		VAL_ARRAY,
+		VAL_LOCAL,
+		VAL_REGEX,
+		VAL_HASH,
+		VAL_ROPE,
+		VAL_SEQ,
 
 		/* GC marker. */
 		VAL_MOVED,
@@ -36,14 +49,42 @@ struct value {
 		VAL_NOTE,
 	} type;
 
+	location loc;
+
 	union {
-		int i;
-		kdgu *s;
+		/*
+		 * String or symbol. A symbol also keeps its hash, and
+		 * the binding cell it was last found in and which
+		 * global environment that's in, see `find_global()`.
+		 * A string that's been indexed into keeps how many
+		 * characters it has and where some of them start, see
+		 * `string_offset()`.
+		 */
+		struct {
+			kdgu *s;
+			unsigned hash;
+			union {
+				struct {
+					struct value *global;
+					struct value *global_env;
+				};
+				struct {
+					unsigned *crumb;
+					unsigned num_char;
+				};
+			};
+		};
+
 		char *errmsg;
 
-		/* Cell. */
+		/*
+		 * Cell. A cell that's been evaluated as a form keeps
+		 * what it expands to, see `expand()'.
+		 */
 		struct {
 			struct value *car, *cdr;
+			struct value *expansion;
+			unsigned epoch;
 		};
 
 		/* Function. */
@@ -51,28 +92,109 @@ struct value {
 			struct value *param;
 			struct value *body;
 			struct value *env;
+			struct code *code;
 		};
 
-		/* Environment. */
+		/*
+		 * Environment. Parameters live in the `num_slot`
+		 * trailing `slot`s, in the order given by `names`;
+		 * anything else defined at runtime goes in the `vars`
+		 * association list. The global environment keeps a
+		 * hash table in `vars` instead, holding `num_global`
+		 * bindings; see `find_global()`.
+		 */
 		struct {
 			struct value *vars;
 			struct value *up;
+			struct value *names;
+			unsigned num_slot, num_global;
 		};
 
-		/* Array. */
+		/* Local variable reference, see `resolve()`. */
+		struct {
+			struct value *name;
+			unsigned depth, index;
+		};
+
+		/* Array, with room for `cap` elements. */
 		struct {
 			struct value **arr;
-			unsigned num;
+			unsigned num, cap;
+		};
+
+		/*
+		 * Hash table of `num_key` keys in `cap_slot` slots,
+		 * `num_dead` of which held keys that have been removed;
+		 * see hash.c.
+		 */
+		struct {
+			struct hash_slot *slots;
+			unsigned num_key, num_dead, cap_slot;
+		};
+
+		/*
+		 * Rope: the text of `left` followed by that of
+		 * `right`, each a string or another rope, `length`
+		 * characters in all and `height` nodes deep. `flat` is
+		 * all of it as one string once that's been needed; see
+		 * rope.c.
+		 */
+		struct {
+			struct value *left, *right, *flat;
+			unsigned length, height;
+		};
+
+		/* Lazy sequence, or an iterator over one; see seq.c. */
+		struct {
+			struct value *source, *proc, *state;
+			int kind;
+		};
+
+		/* Compiled regex, and what it was compiled from. */
+		struct {
+			kdgu *pattern;
+			ktre *re;
+			int opt;
 		};
 
-		/* Builtin. */
-		builtin *prim;
+		/*
+		 * Builtin. Either `prim` is given the list of
+		 * arguments unevaluated, or it's NULL and `fun` is
+		 * given between `min_arg` and `max_arg` (or any
+		 * number if that's -1) evaluated arguments.
+		 */
+		struct {
+			builtin *prim;
+			native *fun;
+			const char *prim_name;
+			int min_arg, max_arg;
+		};
 	};
 
-	struct location *loc;
+	struct value *slot[];
 };
 
+/*
+ * Integers aren't allocated at all: they're kept in the pointer
+ * itself, shifted up by one with the low bit set, which a pointer to
+ * a real value never has. Anything that might be an integer has to
+ * be inspected with `TYPE()` and `LOC()` rather than `->type` and
+ * `->loc`.
+ */
+
+#define IS_INT(X)   ((uintptr_t)(X) & 1)
+#define INT(X)      ((intptr_t)(X) >> 1)
+#define MAKE_INT(X) ((struct value *)(((uintptr_t)(X) << 1) | 1))
+
+#define TYPE(X)	  \
+	({ struct value *v_ = (X); IS_INT(v_) ? VAL_INT : v_->type; })
+#define LOC(X)	  \
+	({ struct value *v_ = (X); IS_INT(v_) ? NOWHERE : v_->loc; })
+
 struct value *Dot, *RParen, *Nil, *True;
+extern unsigned macro_epoch;
+extern FILE *output;
+
 struct value *list_length(struct value *list);
 
 struct value *quote(struct value *v);
@@ -80,17 +202,35 @@ struct value *add_variable(struct value *env,
                            struct value *sym,
                            struct value *body);
 void add_builtin(struct value *env, const char *name, builtin *f);
-struct value *find(struct value *env, struct value *sym);
+void add_native(struct value *env,
+                const char *name,
+                native *f,
+                int min_arg,
+                int max_arg);
+struct value **find(struct value *env, struct value *sym);
+struct value **local(struct value *env, struct value *ref);
+struct value *assign(struct value **p, struct value *v);
+void note_binding(struct value *env, struct value *sym, location loc);
+location find_binding(struct value *env, struct value *v);
 
 struct value *new_environment(void);
+void reset_environment(struct value *env);
+struct value *new_frame(struct value *up, struct value *names);
 struct value *push_env(struct value *env,
                        struct value *vars,
                        struct value *values);
-struct value *new_value(struct location *loc);
+struct value *new_value(int type, location loc);
 
 struct value *cons(struct value *car, struct value *cdr);
 struct value *acons(struct value *x, struct value *y, struct value *a);
-struct value *make_symbol(struct location *loc, const char *s);
+unsigned string_length(struct value *str);
+unsigned string_offset(struct value *str, unsigned i);
+struct value *new_array(location loc, unsigned num);
+void array_push(struct value *arr, struct value *v);
+unsigned hash_bytes(const char *s, size_t len);
+struct value *make_symbol(location loc, const char *s);
+void unlocate_symbols(location lo, location hi);
+struct value *intern(location loc, const char *s, size_t len);
 struct value *expand(struct value *env, struct value *v);
 
 struct value *print_value(FILE *f, struct value *v);
@@ -99,6 +239,6 @@ void print_tree(FILE *f, struct value *v);
 const char **value_name;
 
 #define TYPE_NAME(X) (X > VAL_ERROR ? (char []){X, 0} : value_name[X])
-#define IS_LIST(X) ((X)->type == VAL_NIL || (X)->type == VAL_CELL)
+#define IS_LIST(X) (TYPE(X) == VAL_NIL || TYPE(X) == VAL_CELL)
 
 #endif
@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "location.h"
+
+/*
+ * Every source that's been loaded, in order of their locations. There
+ * can be gaps between them where sources have been taken back. A
+ * source's lines aren't indexed until something asks for a position
+ * in it, which for most programs is never.
+ */
+
+struct source {
+	const char *file;
+	const char *text;
+	location base;         /* Location of the first character.  */
+	unsigned size;         /* Including the terminating NUL.    */
+	unsigned *line;        /* Offset of the start of each line. */
+	unsigned num_line;
+};
+
+static struct source *source;
+static unsigned num_source, cap_source;
+
+/*
+ * Returns the first location with room for `size` more after it, in
+ * the first gap that's big enough or else after the last source, or
+ * NOWHERE if there's no such room left in the 32 bits.
+ */
+
+location
+find_room(size_t size)
+{
+	location next = BUILTIN + 1;
+
+	for (unsigned i = 0; i < num_source; i++) {
+		if (source[i].base - next >= size) return next;
+		next = source[i].base + source[i].size;
+	}
+
+	return size <= UINT32_MAX - next ? next : NOWHERE;
+}
+
+/*
+ * Adds a source at `base`, which `find_room()` has to have found room
+ * at, and returns `base`.
+ */
+
+location
+add_source_at(location base,
+              const char *file,
+              const char *text,
+              size_t len)
+{
+	if (num_source == cap_source) {
+		cap_source = cap_source ? cap_source * 2 : 4;
+		source = realloc(source, cap_source * sizeof *source);
+	}
+
+	unsigned i = num_source;
+	while (i && source[i - 1].base > base) i--;
+	memmove(source + i + 1, source + i,
+	        (num_source++ - i) * sizeof *source);
+
+	/* The terminating NUL gets a location too, for EOF. */
+	source[i] = (struct source){ file, text, base, len + 1, NULL, 0 };
+
+	return base;
+}
+
+/*
+ * Adds a source wherever there's room for it and returns the location
+ * of its first character, or NOWHERE if it won't fit in what's left
+ * of the 32 bits.
+ */
+
+location
+add_source(const char *file, const char *text, size_t len)
+{
+	location base = len < UINT32_MAX ? find_room(len + 1) : NOWHERE;
+	return base ? add_source_at(base, file, text, len) : NOWHERE;
+}
+
+/*
+ * Takes back the source at `base` and returns whether there was one,
+ * so that a later source can go where it was. Its text isn't looked at
+ * after this, so there had better be no locations in it left.
+ */
+
+bool
+remove_source(location base)
+{
+	if (!num_source || base <= BUILTIN) return false;
+
+	unsigned i = find_source(base);
+	if (source[i].base != base) return false;
+
+	free(source[i].line);
+	memmove(source + i, source + i + 1,
+	        (--num_source - i) * sizeof *source);
+
+	return true;
+}
+
+/*
+ * Fills in the details of the `i`th source that was added and returns
+ * its location, or NOWHERE if there aren't that many.
+ */
+
+location
+get_source(unsigned i, const char **file, const char **text, size_t *len)
+{
+	if (i >= num_source) return NOWHERE;
+
+	*file = source[i].file;
+	*text = source[i].text;
+	*len = source[i].size - 1;
+
+	return source[i].base;
+}
+
+/*
+ * Returns the index of the source that `loc` is in, which has to be
+ * in one.
+ */
+
+unsigned
+find_source(location loc)
+{
+	unsigned lo = 0, hi = num_source;
+
+	while (hi - lo > 1) {
+		unsigned mid = (lo + hi) / 2;
+		if (source[mid].base <= loc) lo = mid;
+		else hi = mid;
+	}
+
+	return lo;
+}
+
+static void
+index_lines(struct source *s)
+{
+	unsigned cap = 64;
+	const char *p = s->text, *e = s->text + s->size - 1;
+
+	s->line = malloc(cap * sizeof *s->line);
+	s->line[s->num_line++] = 0;
+
+	while ((p = memchr(p, '\n', e - p))) {
+		if (s->num_line == cap) {
+			cap *= 2;
+			s->line = realloc(s->line, cap * sizeof *s->line);
+		}
+
+		s->line[s->num_line++] = ++p - s->text;
+	}
+}
+
+struct position
+find_position(location loc)
+{
+	static const char none[] = "<none>";
+	static const char internal[] = "<internal implementation>";
+
+	if (loc == NOWHERE)
+		return (struct position){
+			"*none*", none, none + sizeof none - 1, 0, -1, 0
+		};
+	if (loc == BUILTIN)
+		return (struct position){
+			"built-in-function", internal,
+			internal + sizeof internal - 1, 0, 0, 0
+		};
+
+	struct source *s = &source[find_source(loc)];
+	unsigned idx = loc - s->base;
+
+	/* It shouldn't be in the gap after the source, but just in case. */
+	if (idx >= s->size) idx = s->size - 1;
+	if (!s->line) index_lines(s);
+
+	unsigned lo = 0, hi = s->num_line;
+
+	while (hi - lo > 1) {
+		unsigned mid = (lo + hi) / 2;
+		if (s->line[mid] <= idx) lo = mid;
+		else hi = mid;
+	}
+
+	return (struct position){
+		s->file, s->text, s->text + s->size - 1,
+		idx, lo, idx - s->line[lo]
+	};
+}
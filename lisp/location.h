@@ -1,30 +1,45 @@
 #ifndef LOCATION_H
 #define LOCATION_H
 
-struct location {
-	unsigned line, column; /* Line/column of first character.   */
-	unsigned len;          /* Length of the region.             */
-	unsigned idx;          /* Location in the token stream.     */
-	const char *file;      /* Name of the file this is from.    */
-	const char *text;      /* Complete body of the file.        */
-};
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 
-static struct location *NOWHERE = &(struct location){
-	-1,0,0,0,"*none*","<none>"
-};
+/*
+ * A location is an offset into the text of all of the sources that
+ * have been loaded, laid end to end, give or take the gaps left by
+ * ones that have been taken back. That keeps it down to 32 bits
+ * and lets the lexer get away without counting lines and columns;
+ * they're worked out by `find_position()` when an error is printed.
+ *
+ * The first couple of offsets don't belong to any source.
+ */
 
-static struct location *BUILTIN = &(struct location){
-	0,0,0,0,"built-in-function","<internal implementation>"
-};
+typedef uint32_t location;
 
-#include <stdlib.h>
+#define NOWHERE ((location)0) /* Integers and the like.            */
+#define BUILTIN ((location)1) /* Builtin functions.                */
+
+struct position {
+	const char *file;      /* Name of the file this is from.    */
+	const char *text;      /* Complete body of the file.        */
+	const char *end;       /* Its terminating NUL.              */
+	unsigned idx;          /* Offset into `text`.               */
+	unsigned line, column; /* Line/column of the character.     */
+};
 
-static inline struct location *
-copy_location(struct location l)
-{
-	struct location *loc = malloc(sizeof *loc);
-	*loc = l;
-	return loc;
-}
+location find_room(size_t size);
+location add_source_at(location base,
+                       const char *file,
+                       const char *text,
+                       size_t len);
+location add_source(const char *file, const char *text, size_t len);
+bool remove_source(location base);
+location get_source(unsigned i,
+                    const char **file,
+                    const char **text,
+                    size_t *len);
+unsigned find_source(location loc);
+struct position find_position(location loc);
 
 #endif
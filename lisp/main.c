@@ -1,32 +1,303 @@
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "error.h"
+#include "gc.h"
 #include "lex.h"
 #include "util.h"
 #include "parse.h"
 #include "eval.h"
+#include "vm.h"
+#include "image.h"
+#include "incremental.h"
+#include "watch.h"
+#include "profile.h"
+#include "stats.h"
 
-int main(int argc, char **argv)
-{
-	(void)argc;
+/*
+ * `--dump IMAGE` saves the global environment once the file has been
+ * run, and `--image IMAGE` starts from one instead of from scratch.
+ * `--cache FILE` skips the forms that would do the same as they did
+ * the last time it was given, see incremental.c. `--watch` keeps
+ * running the file every time that it's saved. `--profile FILE`
+ * writes where the time went to FILE, as stacks for a flame graph; see
+ * profile.c. `--stats` prints the counters in stats.h.
+ */
+
+static const char *path = "-", *image, *dump, *cache, *profile;
+static bool watch, show_stats;
 
-	struct lexer *lexer = new_lexer(argv[1], load_file(argv[1]));
+/*
+ * Makes a new global environment, loaded from `image` if it's given,
+ * and starts incremental evaluation in it with the records in `records`
+ * if `incremental` is set.
+ */
+
+static struct value *
+start(bool incremental, const char *records)
+{
 	struct value *env = new_environment();
-	struct token *t;
-	unsigned num_error = 0;
+	PROTECT(&env);
+
+	if (image && !load_image(image, env, NULL)) {
+		fprintf(stderr, "error: couldn't load image `%s'\n", image);
+		return NULL;
+	}
+
+	if (incremental) start_incremental(records, env);
+
+	return env;
+}
+
+/*
+ * Empties `env` out and loads `image` into it again, so that the file
+ * can be run again as though for the first time. The records from the
+ * last run are kept.
+ */
+
+static struct value *
+restart(struct value *env)
+{
+	PROTECT(&env);
+	reset_environment(env);
+
+	if (image && !load_image(image, env, NULL)) {
+		fprintf(stderr, "error: couldn't load image `%s'\n", image);
+		return NULL;
+	}
+
+	return env;
+}
+
+/*
+ * The copies of the file that have been read in and are still kept.
+ * What's made from a form that's replayed still has locations in the
+ * copy that the form was first read from, so a copy isn't freed, and
+ * its locations given to another, until nothing from it is left.
+ */
+
+static struct copy {
+	char *text;
+	location base;
+	size_t len;
+} *copies;
+
+static size_t num_copy;
+
+static void
+free_copies(void)
+{
+	size_t n = 0;
+	gc();
 
-	while ((t = tok(lexer, TALK))) {
-		if (t->type != '(') continue;
-		struct value *e = eval(env, parse(env, lexer));
-		if (!e || e->type != VAL_ERROR) continue;
+	for (size_t i = 0; i < num_copy; i++) {
+		struct copy *c = &copies[i];
+		location end = c->base + c->len + 1;
+
+		if (gc_refers(c->base, end) || !remove_source(c->base)) {
+			copies[n++] = *c;
+			continue;
+		}
+
+		unlocate_symbols(c->base, end);
+		free(c->text);
+	}
+
+	num_copy = n;
+}
+
+/*
+ * Runs the file at `path` in `env` and returns the number of errors,
+ * or -1 if it couldn't be read or is too big to be given locations.
+ * The file is read into memory rather than mapped if `copy` is set.
+ */
+
+static int
+run(struct value *env, bool incremental, bool copy)
+{
+	PROTECT(&env);
+
+	size_t len;
+	const char *text = copy ? read_file(path, &len)
+	                        : load_file(path, &len);
+
+	if (!text) {
+		fprintf(stderr, "error: couldn't read `%s'\n", path);
+		return -1;
+	}
+
+	if (copy) free_copies();
+
+	struct lexer *lexer = new_lexer(strcmp(path, "-") ? path : "<stdin>",
+	                                text, len);
+
+	if (!lexer) {
+		fprintf(stderr, "error: `%s' is too big; there's only room "
+		        "for 4 GB of source in all\n", path);
+		if (copy) free((char *)text);
+		return -1;
+	}
+
+	if (copy) {
+		copies = realloc(copies, (num_copy + 1) * sizeof *copies);
+		copies[num_copy++] = (struct copy){
+			(char *)text, lexer->base, len
+		};
+	}
+
+	int num_error = 0;
+
+	for (;;) {
+		struct token t = tok(lexer, TALK);
+		if (t.type == TOK_EOF) break;
+		if (t.type != '(') continue;
+		struct value *e = parse(env, lexer);
+		if (incremental)
+			e = eval_incremental(env, e, t.body,
+			                     lexer->s + lexer->idx - t.body);
+		else e = use_vm ? vm_eval(env, e) : eval(env, e);
+		if (!e || TYPE(e) != VAL_ERROR) continue;
 		print_error(stdout, e);
 		num_error++;
 		if (num_error < 15) continue;
-		print_error(stdout, error(copy_location(t->loc),
+		print_error(stdout, error(t.loc,
 		                    "encountered too many errors"));
 		break;
 	}
 
+	free_lexer(lexer);
+
 	return num_error;
 }
+
+/*
+ * Writes the stacks seen by the profiler to `profile` and a summary of
+ * them to stderr.
+ */
+
+static bool
+write_profile(struct value *env)
+{
+	FILE *f = fopen(profile, "w");
+	if (!f) return false;
+
+	bool ok = profile_report(f, stderr, env);
+
+	return !fclose(f) && ok;
+}
+
+static bool
+finish(struct value *env, bool incremental)
+{
+	if (incremental && !finish_incremental(cache, env)) {
+		fprintf(stderr, "error: couldn't write cache `%s'\n", cache);
+		return false;
+	}
+
+	if (dump && !save_image(dump, env, NULL)) {
+		fprintf(stderr, "error: couldn't write image `%s'\n", dump);
+		return false;
+	}
+
+	if (profile && !write_profile(env)) {
+		fprintf(stderr, "error: couldn't write profile `%s'\n",
+		        profile);
+		return false;
+	}
+
+	if (show_stats) print_stats(stderr);
+
+	return true;
+}
+
+static double
+now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+/*
+ * Runs the file at `path` again every time it changes, so that only
+ * the forms affected by the change are evaluated again. Each run starts
+ * from an empty environment, as a fresh run with the records would,
+ * so that nothing bound by a form that's been taken away is left
+ * behind. The records are thrown away too if `image` changes. Only
+ * returns if something goes wrong.
+ */
+
+static int
+serve(void)
+{
+	struct watcher *w = new_watcher();
+
+	if (!w || (image && !add_watch(w, image)) || !add_watch(w, path)) {
+		fprintf(stderr, "error: couldn't watch `%s'\n", path);
+		return 1;
+	}
+
+	struct value *env = start(true, cache);
+	gc_root(&env);
+
+	for (double t = now();; t = now()) {
+		if (env) {
+			int num_error = run(env, true, true);
+			fflush(stdout);
+			if (num_error >= 0 && finish(env, true))
+				fprintf(stderr, "ran `%s' in %.1fms, %d error%s\n",
+				        path, now() - t, num_error,
+				        num_error == 1 ? "" : "s");
+		}
+
+		int i = next_change(w);
+		if (i < 0) break;
+
+		/* The records are no good if the image has changed. */
+		if (image && !i) env = start(true, NULL);
+		else if (env) env = restart(env);
+	}
+
+	fprintf(stderr, "error: couldn't watch `%s'\n", path);
+	free_watcher(w);
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--vm")) use_vm = true;
+		else if (!strcmp(argv[i], "--watch")) watch = true;
+		else if (!strcmp(argv[i], "--stats")) show_stats = true;
+		else if (!strcmp(argv[i], "--dump") && i + 1 < argc)
+			dump = argv[++i];
+		else if (!strcmp(argv[i], "--image") && i + 1 < argc)
+			image = argv[++i];
+		else if (!strcmp(argv[i], "--cache") && i + 1 < argc)
+			cache = argv[++i];
+		else if (!strcmp(argv[i], "--profile") && i + 1 < argc)
+			profile = argv[++i];
+		else path = argv[i];
+	}
+
+	output = stdout;
+	profiling = profile;
+
+	if (watch && !strcmp(path, "-")) {
+		fprintf(stderr, "error: can't watch standard input\n");
+		return 1;
+	}
+
+	if (watch) return serve();
+
+	struct value *env = start(cache, cache);
+	gc_root(&env);
+	if (!env) return 1;
+
+	int num_error = run(env, cache, false);
+	if (num_error < 0) return 1;
+
+	return finish(env, cache) ? num_error : 1;
+}
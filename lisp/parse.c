@@ -2,62 +2,68 @@
 #include <string.h>
 
 #include "error.h"
+#include "gc.h"
 #include "parse.h"
 #include "lex.h"
 #include "eval.h"
 
+/*
+ * Parses one expression. If `where` isn't NULL it receives the
+ * location of the expression's first token; symbols are shared
+ * between all of their uses and integers aren't allocated, so neither
+ * carries one itself.
+ */
+
 static struct value *
-parse_expr(struct value *env, struct lexer *l)
+parse_expr(struct value *env, struct lexer *l, location *where)
 {
-	struct token *t = tok(l, CODE);
-	if (!t) return NULL;
+	struct token t = tok(l, CODE);
+	if (t.type == TOK_EOF) return NULL;
+
+	location loc = t.loc;
+	if (where) *where = loc;
 
 	/*
 	 * The cast to int is here to suppress the `case value 'x' not
 	 * in enumerated type` warning GCC emits.
 	 */
 
-	switch ((int)t->type) {
+	switch ((int)t.type) {
 	case '(': return parse(env, l);
 	case ')': return RParen;
 	case '.': return Dot;
-	case '\'': return quote(parse_expr(env, l));
+	case '\'': return quote(parse_expr(env, l, NULL));
 	case '[': {
-		struct value *v = new_value(&t->loc);
-		v->type = VAL_ARRAY;
-		struct value *arr[512];
-		unsigned num = 0;
-
-		while ((t = tok(l, CODE)) && t->type != ']') {
-			l->loc = t->loc;
-			arr[num++] = parse_expr(env, l);
+		struct value *v = new_array(loc, 0), *e;
+		PROTECT(&v);
+
+		for (;;) {
+			size_t idx = l->idx;
+			t = tok(l, CODE);
+			if (t.type == TOK_EOF || t.type == ']') break;
+			l->idx = idx;
+			e = parse_expr(env, l, NULL);
+			array_push(v, e);
 		}
 
-		v->arr = malloc(num * sizeof *v->arr);
-		memcpy(v->arr, arr, num * sizeof *v->arr);
-		v->num = num;
 		return v;
 	} break;
 
 	case TOK_IDENT:
-		return make_symbol(copy_location(t->loc), t->body);
+		return intern(loc, t.body, t.len);
 
 	case TOK_STR: {
-		struct value *v = new_value(&t->loc);
-		v->type = VAL_STRING;
-		v->s = kdgu_copy(t->s);
+		struct value *v = new_value(VAL_STRING, loc);
+		v->s = token_string(&t);
 		return v;
 	} break;
 
-	case TOK_INT: {
-		struct value *v = new_value(&t->loc);
-		v->type = VAL_INT;
-		v->i = t->i;
-		return v;
-	} break;
+	case TOK_INT:
+		return MAKE_INT(t.i);
 
 	default:
-		return error(&t->loc, "unexpected `%s'", t->body);
+		return error(loc, "unexpected `%.*s'",
+		             (int)t.len, t.body);
 	}
 
 	return NULL;
@@ -66,30 +72,33 @@ parse_expr(struct value *env, struct lexer *l)
 struct value *
 parse(struct value *env, struct lexer *l)
 {
-	struct value *head = Nil, *tail = head;
+	struct value *head = Nil, *tail = head, *o = NULL;
+	location open = l->base + l->idx - 1;
+	PROTECT(&env, &head, &tail, &o);
 
 	for (;;) {
-		struct location *loc = copy_location(l->loc);
-		struct value *o = parse_expr(env, l);
-		if (!o) return error(loc, "unmatched `('");
-		free(loc);
+		location where;
+		o = parse_expr(env, l, &where);
+		if (!o) return error(open, "unmatched `('");
 		if (o == RParen) return head;
 
 		if (o == Dot) {
-			tail->cdr = parse_expr(env, l);
-			if (parse_expr(env, l) != RParen)
-				return error(copy_location(l->loc),
-				             "expected `)'");
+			struct value *cdr = parse_expr(env, l, &where);
+			tail->cdr = cdr;
+			if (parse_expr(env, l, &where) != RParen)
+				return error(where, "expected `)'");
 			return head;
 		}
 
-		if (head->type == VAL_NIL) {
-			head = cons(o, Nil);
-			tail = head;
+		struct value *c = cons(o, Nil);
+		if (TYPE(o) == VAL_SYMBOL || IS_INT(o)) c->loc = where;
+
+		if (TYPE(head) == VAL_NIL) {
+			head = tail = c;
 			continue;
 		}
 
-		tail->cdr = cons(o, Nil);
-		tail = tail->cdr;
+		tail->cdr = c;
+		tail = c;
 	}
 }
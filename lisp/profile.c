@@ -0,0 +1,353 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "stats.h"
+#include "profile.h"
+#include "lisp.h"
+
+/*
+ * The profiler. While `profiling` is set the evaluator and the VM say
+ * whenever they enter a function, macro or builtin, and the profiler
+ * keeps its own stack of calls alongside theirs. Everything that
+ * happens between two of these events (time spent and allocations
+ * made) is charged to whatever's on top of that stack.
+ *
+ * Functions and macros are told apart by where they were defined, so
+ * every closure made by the same `fn` form counts as the same one.
+ * A tail call replaces the call it's made from, just as it does in
+ * the evaluator.
+ */
+
+bool profiling;
+unsigned profile_depth;
+
+enum { SITE_FUNCTION, SITE_MACRO, SITE_BUILTIN };
+
+struct site {
+	int kind;
+	uintptr_t key;         /* Location, or builtin name.         */
+	unsigned long long calls;
+	unsigned long long incl_ns, excl_ns;
+	unsigned long long incl_alloc, excl_alloc;
+	unsigned active;       /* Calls to it on the stack.          */
+};
+
+/*
+ * Every distinct stack that's been seen, as a tree. Node 0 is the top
+ * level.
+ */
+
+struct node {
+	unsigned site, parent, child, next;
+	unsigned long long self_ns;
+};
+
+struct frame {
+	unsigned node;
+	unsigned long long start_ns, start_alloc;
+};
+
+static struct site *site;
+static unsigned num_site, cap_site;
+static unsigned *site_tab, cap_site_tab;
+
+static struct node *node;
+static unsigned num_node, cap_node;
+
+static struct frame *stack;
+static unsigned cap_stack;
+
+static unsigned long long last_ns, last_alloc;
+
+static unsigned long long
+now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static unsigned
+hash_site(int kind, uintptr_t key)
+{
+	uint64_t h = (key * 2 + kind) * 0x9e3779b97f4a7c15ULL;
+	return h >> 32;
+}
+
+static void
+insert_site(unsigned i)
+{
+	unsigned mask = cap_site_tab - 1;
+	unsigned j = hash_site(site[i].kind, site[i].key) & mask;
+	while (site_tab[j]) j = (j + 1) & mask;
+	site_tab[j] = i + 1;
+}
+
+static unsigned
+find_site(struct value *fn)
+{
+	int kind = TYPE(fn) == VAL_BUILTIN ? SITE_BUILTIN
+		: TYPE(fn) == VAL_MACRO ? SITE_MACRO : SITE_FUNCTION;
+	uintptr_t key = kind == SITE_BUILTIN ? (uintptr_t)fn->prim_name
+		: LOC(fn->body) ? LOC(fn->body) : fn->loc;
+
+	if ((num_site + 1) * 2 > cap_site_tab) {
+		free(site_tab);
+		cap_site_tab = cap_site_tab ? cap_site_tab * 2 : 64;
+		site_tab = calloc(cap_site_tab, sizeof *site_tab);
+		for (unsigned i = 0; i < num_site; i++) insert_site(i);
+	}
+
+	unsigned mask = cap_site_tab - 1, j = hash_site(kind, key) & mask;
+
+	for (; site_tab[j]; j = (j + 1) & mask) {
+		struct site *s = &site[site_tab[j] - 1];
+		if (s->kind == kind && s->key == key) return site_tab[j] - 1;
+	}
+
+	if (num_site == cap_site) {
+		cap_site = cap_site ? cap_site * 2 : 64;
+		site = realloc(site, cap_site * sizeof *site);
+	}
+
+	site[num_site] = (struct site){ .kind = kind, .key = key };
+	site_tab[j] = ++num_site;
+
+	return num_site - 1;
+}
+
+static unsigned
+find_child(unsigned parent, unsigned s)
+{
+	unsigned *p = &node[parent].child;
+
+	for (; *p; p = &node[*p].next)
+		if (node[*p].site == s) return *p;
+
+	if (num_node == cap_node) {
+		cap_node *= 2;
+		node = realloc(node, cap_node * sizeof *node);
+	}
+
+	node[num_node] = (struct node){ s, parent, 0, node[parent].child, 0 };
+	node[parent].child = num_node;
+
+	return num_node++;
+}
+
+/*
+ * Charges everything since the last event to the call on top of the
+ * stack, or to the top level.
+ */
+
+static void
+charge(unsigned long long t)
+{
+	struct frame *f = profile_depth ? &stack[profile_depth - 1] : NULL;
+	unsigned n = f ? f->node : 0;
+
+	node[n].self_ns += t - last_ns;
+
+	if (f) {
+		site[node[n].site].excl_ns += t - last_ns;
+		site[node[n].site].excl_alloc += stats.alloc - last_alloc;
+	}
+
+	last_ns = t;
+	last_alloc = stats.alloc;
+}
+
+static void
+leave(unsigned long long t)
+{
+	struct frame *f = &stack[--profile_depth];
+	struct site *s = &site[node[f->node].site];
+
+	/* Recursive calls are already counted by the outermost one. */
+
+	if (--s->active) return;
+	s->incl_ns += t - f->start_ns;
+	s->incl_alloc += stats.alloc - f->start_alloc;
+}
+
+/*
+ * Enters a call to `fn`. If `replace` is set it's a tail call, which
+ * leaves the call on top of the stack first.
+ */
+
+void
+profile_call(struct value *fn, bool replace)
+{
+	unsigned long long t = now();
+
+	if (!node) {
+		cap_node = 256;
+		node = malloc(cap_node * sizeof *node);
+		node[num_node++] = (struct node){ 0 };
+		last_ns = t;
+		last_alloc = stats.alloc;
+	}
+
+	charge(t);
+	if (replace && profile_depth) leave(t);
+
+	unsigned s = find_site(fn);
+	unsigned parent = profile_depth ? stack[profile_depth - 1].node : 0;
+	unsigned n = find_child(parent, s);
+
+	if (profile_depth == cap_stack) {
+		cap_stack = cap_stack ? cap_stack * 2 : 256;
+		stack = realloc(stack, cap_stack * sizeof *stack);
+	}
+
+	stack[profile_depth++] = (struct frame){ n, t, stats.alloc };
+	site[s].calls++;
+	site[s].active++;
+}
+
+/*
+ * Leaves calls until there are only `depth` left.
+ */
+
+void
+profile_pop(unsigned depth)
+{
+	unsigned long long t = now();
+	charge(t);
+	while (profile_depth > depth) leave(t);
+}
+
+/*
+ * Finds the names that the functions and macros that were called are
+ * bound to in the global environment `env`, if they are.
+ */
+
+static struct value **
+name_sites(struct value *env)
+{
+	struct value **name = calloc(num_site + 1, sizeof *name);
+	struct value *tab = env->vars;
+	if (TYPE(tab) != VAL_ARRAY) return name;
+
+	for (unsigned i = 0; i < tab->num; i++) {
+		struct value *c = tab->arr[i];
+		if (!c || (TYPE(c->cdr) != VAL_FUNCTION
+		           && TYPE(c->cdr) != VAL_MACRO))
+			continue;
+
+		struct value *fn = c->cdr;
+		int kind = TYPE(fn) == VAL_MACRO ? SITE_MACRO : SITE_FUNCTION;
+		uintptr_t key = LOC(fn->body) ? LOC(fn->body) : fn->loc;
+		unsigned mask = cap_site_tab - 1, j = hash_site(kind, key) & mask;
+
+		for (; site_tab[j]; j = (j + 1) & mask) {
+			struct site *s = &site[site_tab[j] - 1];
+			if (s->kind == kind && s->key == key)
+				name[site_tab[j] - 1] = c->car;
+		}
+	}
+
+	return name;
+}
+
+static void
+print_site(FILE *f, unsigned i, struct value **name)
+{
+	struct site *s = &site[i];
+
+	if (s->kind == SITE_BUILTIN) {
+		fputs((const char *)s->key, f);
+		return;
+	}
+
+	if (name[i]) kdgu_print(name[i]->s, f);
+	else fputs(s->kind == SITE_MACRO ? "macro" : "fn", f);
+
+	struct position p = find_position(s->key);
+	fprintf(f, " %s:%u:%u", p.file, p.line + 1, p.column);
+}
+
+/*
+ * Writes the stacks in the collapsed format that flame graph tools
+ * take: the calls on the stack from the outside in, separated by
+ * semicolons, then how many nanoseconds were spent with exactly that
+ * stack.
+ */
+
+static void
+print_stacks(FILE *f, struct value **name)
+{
+	unsigned *path = malloc(num_node * sizeof *path);
+
+	for (unsigned i = 0; i < num_node; i++) {
+		if (!node[i].self_ns) continue;
+
+		unsigned len = 0;
+		for (unsigned n = i; n; n = node[n].parent) path[len++] = n;
+
+		fputs("top-level", f);
+
+		while (len--) {
+			fputc(';', f);
+			print_site(f, node[path[len]].site, name);
+		}
+
+		fprintf(f, " %llu\n", node[i].self_ns);
+	}
+
+	free(path);
+}
+
+static int
+by_excl(const void *a, const void *b)
+{
+	const struct site *x = &site[*(const unsigned *)a];
+	const struct site *y = &site[*(const unsigned *)b];
+	return (x->excl_ns < y->excl_ns) - (x->excl_ns > y->excl_ns);
+}
+
+static void
+print_summary(FILE *f, struct value **name)
+{
+	unsigned *order = malloc((num_site + 1) * sizeof *order);
+	for (unsigned i = 0; i < num_site; i++) order[i] = i;
+	qsort(order, num_site, sizeof *order, by_excl);
+
+	fprintf(f, "%10s %10s %10s %10s %10s  %s\n", "calls", "incl ms",
+	        "excl ms", "incl alloc", "excl alloc", "name");
+
+	for (unsigned i = 0; i < num_site; i++) {
+		struct site *s = &site[order[i]];
+		fprintf(f, "%10llu %10.3f %10.3f %10llu %10llu  ",
+		        s->calls, s->incl_ns / 1e6, s->excl_ns / 1e6,
+		        s->incl_alloc, s->excl_alloc);
+		print_site(f, order[i], name);
+		fputc('\n', f);
+	}
+
+	free(order);
+}
+
+/*
+ * Writes the stacks seen so far to `stacks` and a table of the
+ * functions, macros and builtins that were called, most expensive
+ * first, to `summary`. Calls that haven't finished yet haven't been
+ * counted in their inclusive figures.
+ */
+
+bool
+profile_report(FILE *stacks, FILE *summary, struct value *env)
+{
+	if (!node) return true;
+
+	charge(now());
+	struct value **name = name_sites(env);
+
+	print_stacks(stacks, name);
+	print_summary(summary, name);
+	free(name);
+
+	return !ferror(stacks);
+}
@@ -0,0 +1,30 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "lisp.h"
+
+extern bool profiling;
+extern unsigned profile_depth;
+
+void profile_call(struct value *fn, bool replace);
+void profile_pop(unsigned depth);
+bool profile_report(FILE *stacks, FILE *summary, struct value *env);
+
+/*
+ * Leaves every call that's been entered since `*mark` was taken. It's
+ * meant for `PROFILE_MARK()`, so that a function that enters calls
+ * leaves them again however it returns.
+ */
+
+static inline void
+profile_unwind(unsigned *mark)
+{
+	if (profile_depth > *mark) profile_pop(*mark);
+}
+
+#define PROFILE_MARK(X) \
+	unsigned X __attribute__((cleanup(profile_unwind))) = profile_depth
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "regex.h"
+#include "stats.h"
+
+/*
+ * ktre compiles a pattern into a program every time it's given one,
+ * which for a substitution in a loop is most of the work. The programs
+ * for patterns that are given as strings are kept here instead, up to
+ * `CACHE_SIZE` of them; when it's full the one that was used longest
+ * ago is thrown out.
+ *
+ * The cache owns the programs, so one is only good until the next
+ * call to `cached_regex()`.
+ */
+
+#define CACHE_SIZE 64
+
+static struct entry {
+	uint64_t hash;
+	kdgu *pattern;
+	int opt;
+	ktre *re;
+	unsigned long long used;
+} cache[CACHE_SIZE];
+
+static unsigned long long tick;
+
+static uint64_t
+hash_pattern(const kdgu *k, int opt)
+{
+	uint64_t h = 14695981039346656037ULL ^ opt;
+
+	for (unsigned i = 0; i < k->len; i++) {
+		h ^= (unsigned char)k->s[i];
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+/*
+ * Returns the ktre options spelled out by the mode modifiers in
+ * `options`, or -1 if there's one we don't know.
+ */
+
+int
+regex_options(const kdgu *options)
+{
+	int opt = 0;
+
+	for (unsigned i = 0; i < options->len; i++) {
+		switch (options->s[i]) {
+		case 'g': opt |= KTRE_GLOBAL; break;
+		case 'i': opt |= KTRE_INSENSITIVE; break;
+		default: return -1;
+		}
+	}
+
+	return opt;
+}
+
+/*
+ * Returns the program for `pattern` compiled with `opt`. It has to be
+ * checked for an error like any other.
+ */
+
+ktre *
+cached_regex(const kdgu *pattern, int opt)
+{
+	uint64_t hash = hash_pattern(pattern, opt);
+	struct entry *victim = &cache[0];
+
+	tick++;
+
+	for (unsigned i = 0; i < CACHE_SIZE; i++) {
+		struct entry *e = &cache[i];
+
+		if (e->re && e->hash == hash && e->opt == opt
+		    && e->pattern->len == pattern->len
+		    && !memcmp(e->pattern->s, pattern->s, pattern->len)) {
+			e->used = tick;
+			stats.regex_hit++;
+			return e->re;
+		}
+
+		if (e->used < victim->used) victim = e;
+	}
+
+	if (victim->re) ktre_free(victim->re);
+	if (victim->pattern) kdgu_free(victim->pattern);
+
+	stats.regex_compile++;
+
+	*victim = (struct entry){
+		hash,
+		kdgu_copy((kdgu *)pattern),
+		opt,
+		ktre_compile((kdgu *)pattern, opt),
+		tick
+	};
+
+	return victim->re;
+}
@@ -0,0 +1,9 @@
+#ifndef REGEX_H
+#define REGEX_H
+
+#include <kdg/kdgu.h>
+
+int regex_options(const kdgu *options);
+ktre *cached_regex(const kdgu *pattern, int opt);
+
+#endif
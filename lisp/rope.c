@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc.h"
+#include "rope.h"
+
+/*
+ * Ropes. Text that's built up a piece at a time is kept as a tree of
+ * the pieces rather than copied into a new string every time, so that
+ * joining two texts or taking part of one only makes O(log n) nodes.
+ * The tree is kept balanced as an AVL tree is. Short pieces next to
+ * each other are merged into one string, up to `ROPE_LEAF` bytes,
+ * so that a rope built a word at a time doesn't end up with a node
+ * for every word.
+ *
+ * A rope is only made into one string when something needs it as one;
+ * printing one doesn't. The pieces are taken to all be in the same
+ * encoding.
+ */
+
+#define ROPE_LEAF 256
+
+static unsigned
+height(struct value *t)
+{
+	return TYPE(t) == VAL_ROPE ? t->height : 0;
+}
+
+static bool
+little(struct value *t)
+{
+	return TYPE(t) == VAL_STRING && t->s->len <= ROPE_LEAF;
+}
+
+unsigned
+text_length(struct value *t)
+{
+	return TYPE(t) == VAL_ROPE ? t->length : string_length(t);
+}
+
+static struct value *
+node(struct value *l, struct value *r)
+{
+	PROTECT(&l, &r);
+	struct value *t = new_value(VAL_ROPE, NOWHERE);
+
+	t->left = l;
+	t->right = r;
+	t->length = text_length(l) + text_length(r);
+	t->height = 1 + (height(l) > height(r) ? height(l) : height(r));
+
+	return t;
+}
+
+/*
+ * Makes the node for `l` followed by `r`, which differ in height by at
+ * most two, rotating it if they differ by two.
+ */
+
+static struct value *
+balance(struct value *l, struct value *r)
+{
+	struct value *a = NULL, *b = NULL;
+	PROTECT(&l, &r, &a, &b);
+
+	if (height(l) > height(r) + 1) {
+		if (height(l->left) >= height(l->right)) {
+			a = node(l->right, r);
+			return node(l->left, a);
+		}
+
+		a = node(l->left, l->right->left);
+		b = node(l->right->right, r);
+		return node(a, b);
+	}
+
+	if (height(r) > height(l) + 1) {
+		if (height(r->right) >= height(r->left)) {
+			a = node(l, r->left);
+			return node(a, r->right);
+		}
+
+		a = node(l, r->left->left);
+		b = node(r->left->right, r->right);
+		return node(a, b);
+	}
+
+	return node(l, r);
+}
+
+static struct value *
+merge(struct value *a, struct value *b)
+{
+	size_t len = a->s->len + b->s->len;
+	char *buf = malloc(len + 1);
+
+	memcpy(buf, a->s->s, a->s->len);
+	memcpy(buf + a->s->len, b->s->s, b->s->len);
+
+	kdgu *k = kdgu_new(a->s->fmt, buf, len);
+	free(buf);
+
+	struct value *t = new_value(VAL_STRING, NOWHERE);
+	t->s = k;
+
+	return t;
+}
+
+/*
+ * Returns the text of `a` followed by that of `b`.
+ */
+
+struct value *
+rope_concat(struct value *a, struct value *b)
+{
+	if (TYPE(a) == VAL_STRING && !a->s->len) return b;
+	if (TYPE(b) == VAL_STRING && !b->s->len) return a;
+
+	if (little(a) && little(b) && a->s->len + b->s->len <= ROPE_LEAF)
+		return merge(a, b);
+
+	struct value *t = NULL;
+	PROTECT(&a, &b, &t);
+
+	if (TYPE(a) == VAL_ROPE && little(a->right) && little(b)
+	    && a->right->s->len + b->s->len <= ROPE_LEAF) {
+		t = merge(a->right, b);
+		return balance(a->left, t);
+	}
+
+	if (TYPE(b) == VAL_ROPE && little(a) && little(b->left)
+	    && a->s->len + b->left->s->len <= ROPE_LEAF) {
+		t = merge(a, b->left);
+		return balance(t, b->right);
+	}
+
+	if (height(a) > height(b) + 1) {
+		t = rope_concat(a->right, b);
+		return balance(a->left, t);
+	}
+
+	if (height(b) > height(a) + 1) {
+		t = rope_concat(a, b->left);
+		return balance(t, b->right);
+	}
+
+	return node(a, b);
+}
+
+/*
+ * Returns the characters of `t` from `start` up to but not including
+ * `end`, which have to be in bounds. Whole pieces are shared with `t`;
+ * only the ones at either end are copied.
+ */
+
+struct value *
+rope_substring(struct value *t, unsigned start, unsigned end)
+{
+	if (!start && end == text_length(t)) return t;
+
+	if (TYPE(t) == VAL_STRING) {
+		unsigned from = string_offset(t, start);
+		kdgu *k = kdgu_new(t->s->fmt, t->s->s + from,
+		                   string_offset(t, end) - from);
+		struct value *r = new_value(VAL_STRING, NOWHERE);
+		r->s = k;
+		return r;
+	}
+
+	unsigned n = text_length(t->left);
+	if (end <= n) return rope_substring(t->left, start, end);
+	if (start >= n) return rope_substring(t->right, start - n, end - n);
+
+	struct value *l = NULL, *r = NULL;
+	PROTECT(&t, &l, &r);
+
+	l = rope_substring(t->left, start, n);
+	r = rope_substring(t->right, 0, end - n);
+
+	return rope_concat(l, r);
+}
+
+static size_t
+count_bytes(struct value *t)
+{
+	if (TYPE(t) == VAL_STRING) return t->s->len;
+	if (t->flat) return t->flat->s->len;
+	return count_bytes(t->left) + count_bytes(t->right);
+}
+
+static char *
+copy_bytes(struct value *t, char *p)
+{
+	if (TYPE(t) == VAL_ROPE && t->flat) t = t->flat;
+
+	if (TYPE(t) == VAL_STRING) {
+		memcpy(p, t->s->s, t->s->len);
+		return p + t->s->len;
+	}
+
+	return copy_bytes(t->right, copy_bytes(t->left, p));
+}
+
+/*
+ * Returns the text of `t` as one string. A rope keeps the string, so
+ * it's only made once.
+ */
+
+struct value *
+rope_flatten(struct value *t)
+{
+	if (TYPE(t) == VAL_STRING) return t;
+	if (t->flat) return t->flat;
+
+	size_t len = count_bytes(t);
+	char *buf = malloc(len + 1);
+	copy_bytes(t, buf);
+
+	struct value *first = t;
+	while (TYPE(first) == VAL_ROPE) first = first->left;
+
+	kdgu *k = kdgu_new(first->s->fmt, buf, len);
+	free(buf);
+
+	PROTECT(&t);
+	struct value *str = new_value(VAL_STRING, NOWHERE);
+	str->s = k;
+	t->flat = str;
+
+	return str;
+}
+
+void
+print_rope(FILE *f, struct value *t)
+{
+	if (TYPE(t) == VAL_ROPE && t->flat) t = t->flat;
+
+	if (TYPE(t) == VAL_STRING) {
+		kdgu_print(t->s, f);
+		return;
+	}
+
+	print_rope(f, t->left);
+	print_rope(f, t->right);
+}
@@ -0,0 +1,15 @@
+#ifndef ROPE_H
+#define ROPE_H
+
+#include <stdio.h>
+#include "lisp.h"
+
+#define IS_TEXT(V) (TYPE(V) == VAL_STRING || TYPE(V) == VAL_ROPE)
+
+unsigned text_length(struct value *t);
+struct value *rope_concat(struct value *a, struct value *b);
+struct value *rope_substring(struct value *t, unsigned start, unsigned end);
+struct value *rope_flatten(struct value *t);
+void print_rope(FILE *f, struct value *t);
+
+#endif
@@ -0,0 +1,122 @@
+#include "gc.h"
+#include "eval.h"
+#include "seq.h"
+
+/*
+ * Lazy sequences. A sequence only says where its elements come from:
+ * a range, a list or an array, or another sequence with a function
+ * mapped over it, filtered by one, or cut short. Nothing's computed
+ * until something asks for the elements, and then they're made one at
+ * a time and dropped as soon as they've been used, so a pipeline over
+ * millions of elements runs in the same memory as one over ten.
+ *
+ * Asking for the elements starts an iterator, which is a copy of the
+ * chain of sequences that keeps its place in each. The sequence itself
+ * never changes, so it can be gone through any number of times.
+ */
+
+struct value *
+new_seq(location loc,
+        int kind,
+        struct value *source,
+        struct value *proc,
+        struct value *state)
+{
+	PROTECT(&source, &proc, &state);
+	struct value *seq = new_value(VAL_SEQ, loc);
+
+	seq->kind = kind;
+	seq->source = source;
+	seq->proc = proc;
+	seq->state = state;
+
+	return seq;
+}
+
+/*
+ * Returns `v` as a sequence if it's a sequence, a list or an array,
+ * and NULL otherwise.
+ */
+
+struct value *
+as_seq(location loc, struct value *v)
+{
+	if (TYPE(v) == VAL_SEQ) return v;
+	if (IS_LIST(v)) return new_seq(loc, SEQ_LIST, v, Nil, Nil);
+	if (TYPE(v) == VAL_ARRAY)
+		return new_seq(loc, SEQ_ARRAY, v, Nil, MAKE_INT(0));
+	return NULL;
+}
+
+/*
+ * Returns a new iterator over the elements of `seq`.
+ */
+
+struct value *
+seq_start(struct value *seq)
+{
+	struct value *source = seq->source;
+	PROTECT(&seq, &source);
+
+	if (seq->kind >= SEQ_MAP) source = seq_start(source);
+
+	return new_seq(seq->loc, seq->kind, source, seq->proc, seq->state);
+}
+
+/*
+ * Moves the iterator `it` on and returns the element it was at, or
+ * NULL if there aren't any more. Calls are blamed on `loc`.
+ */
+
+struct value *
+seq_next(struct value *env, location loc, struct value *it)
+{
+	struct value *v = NULL, *keep;
+	PROTECT(&env, &it, &v);
+
+	switch (it->kind) {
+	case SEQ_RANGE: {
+		intptr_t at = INT(it->source), step = INT(it->state);
+
+		if (it->proc != Nil
+		    && (step > 0 ? at >= INT(it->proc) : at <= INT(it->proc)))
+			return NULL;
+
+		it->source = MAKE_INT(at + step);
+		return MAKE_INT(at);
+	}
+
+	case SEQ_LIST:
+		if (TYPE(it->source) != VAL_CELL) return NULL;
+		v = it->source->car;
+		it->source = it->source->cdr;
+		return v;
+
+	case SEQ_ARRAY:
+		if (INT(it->state) >= it->source->num) return NULL;
+		v = it->source->arr[INT(it->state)];
+		it->state = MAKE_INT(INT(it->state) + 1);
+		return v;
+
+	case SEQ_MAP:
+		v = seq_next(env, loc, it->source);
+		if (!v || TYPE(v) == VAL_ERROR) return v;
+		return invoke(env, loc, it->proc, 1, &v);
+
+	case SEQ_FILTER:
+		for (;;) {
+			v = seq_next(env, loc, it->source);
+			if (!v || TYPE(v) == VAL_ERROR) return v;
+			keep = invoke(env, loc, it->proc, 1, &v);
+			if (TYPE(keep) == VAL_ERROR) return keep;
+			if (TYPE(keep) == VAL_TRUE) return v;
+		}
+
+	case SEQ_TAKE:
+		if (INT(it->state) <= 0) return NULL;
+		it->state = MAKE_INT(INT(it->state) - 1);
+		return seq_next(env, loc, it->source);
+	}
+
+	return NULL;
+}
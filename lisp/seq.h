@@ -0,0 +1,24 @@
+#ifndef SEQ_H
+#define SEQ_H
+
+#include "lisp.h"
+
+enum {
+	SEQ_RANGE,  /* Ints from `source` up to `proc` by `state`.   */
+	SEQ_LIST,   /* The elements of the list `source`.            */
+	SEQ_ARRAY,  /* The elements of `source` from index `state`.  */
+	SEQ_MAP,    /* `proc` applied to each element of `source`.   */
+	SEQ_FILTER, /* The elements of `source` that `proc` is t for. */
+	SEQ_TAKE    /* The first `state` elements of `source`.       */
+};
+
+struct value *new_seq(location loc,
+                      int kind,
+                      struct value *source,
+                      struct value *proc,
+                      struct value *state);
+struct value *as_seq(location loc, struct value *v);
+struct value *seq_start(struct value *seq);
+struct value *seq_next(struct value *env, location loc, struct value *it);
+
+#endif
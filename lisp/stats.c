@@ -0,0 +1,49 @@
+#include <sys/resource.h>
+
+#include "stats.h"
+#include "gc.h"
+
+struct stats stats;
+
+/*
+ * Prints the counters as `name value` lines, which are easy to pick
+ * out of a log with a script. Counters that are still zero are left
+ * out of the breakdowns.
+ */
+
+void
+print_stats(FILE *f)
+{
+	for (unsigned i = 0; i <= VAL_NOTE; i++)
+		if (stats.value[i])
+			fprintf(f, "values.%s %llu\n",
+			        i == VAL_NOTE ? "note" : value_name[i],
+			        stats.value[i]);
+
+	fprintf(f, "gc.allocations %llu\n", stats.alloc);
+	fprintf(f, "gc.bytes %llu\n", stats.allocated);
+	fprintf(f, "gc.collections %llu\n", stats.collection);
+	if (gc_used() > stats.peak_live) stats.peak_live = gc_used();
+	fprintf(f, "gc.peak_live_bytes %llu\n", stats.peak_live);
+	fprintf(f, "gc.peak_heap_bytes %llu\n", stats.peak_heap);
+
+	fprintf(f, "find.calls %llu\n", stats.find);
+	for (unsigned i = 1; i <= STATS_FRAMES; i++)
+		if (stats.frames[i])
+			fprintf(f, "find.frames.%u%s %llu\n", i,
+			        i == STATS_FRAMES ? "+" : "", stats.frames[i]);
+	fprintf(f, "find.bindings %llu\n", stats.binding);
+
+	fprintf(f, "expand.calls %llu\n", stats.expand);
+	fprintf(f, "expand.hits %llu\n", stats.expand_hit);
+	fprintf(f, "expand.expansions %llu\n", stats.expansion);
+
+	fprintf(f, "eval_list.lists %llu\n", stats.list);
+	fprintf(f, "lexer.tokens %llu\n", stats.token);
+	fprintf(f, "regex.hits %llu\n", stats.regex_hit);
+	fprintf(f, "regex.compiles %llu\n", stats.regex_compile);
+
+	struct rusage r;
+	if (!getrusage(RUSAGE_SELF, &r))
+		fprintf(f, "rss.peak_kb %ld\n", r.ru_maxrss);
+}
@@ -0,0 +1,41 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include "lisp.h"
+
+/*
+ * Counters kept by the interpreter as it runs. They're always kept,
+ * since bumping one costs next to nothing; `--stats` just prints them.
+ */
+
+#define STATS_FRAMES 16
+
+struct stats {
+	/* Values made, by type, and everything the collector did. */
+	unsigned long long value[VAL_NOTE + 1];
+	unsigned long long alloc, allocated;
+	unsigned long long collection, peak_live, peak_heap;
+
+	/*
+	 * Calls to `find()`, by how many frames each one looked in
+	 * (the last bucket is that many or more), and how many local
+	 * bindings were looked at.
+	 */
+	unsigned long long find, frames[STATS_FRAMES + 1], binding;
+
+	/* Forms `expand()` was asked about, cached or expanded. */
+	unsigned long long expand, expand_hit, expansion;
+
+	unsigned long long list;  /* Lists made by `eval_list()`.     */
+	unsigned long long token; /* Tokens produced by the lexer.     */
+
+	/* Regexes found in the cache, or compiled; see regex.c. */
+	unsigned long long regex_hit, regex_compile;
+};
+
+extern struct stats stats;
+
+void print_stats(FILE *f);
+
+#endif
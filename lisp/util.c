@@ -1,28 +1,108 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "util.h"
 
+/*
+ * Regular files are mapped rather than read, so that a big document
+ * doesn't end up in memory twice. The mapping is laid over a reserved
+ * run of zeroed pages that's at least a byte longer than the file,
+ * which gives the lexer its NUL terminator without writing to the
+ * file.
+ */
+
+static char *
+map_file(int fd, size_t len)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = (len / page + 1) * page;
+
+	char *b = mmap(NULL, size, PROT_READ,
+	               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b == MAP_FAILED) return NULL;
+
+	if (len && mmap(b, len, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+	                fd, 0) == MAP_FAILED)
+		return munmap(b, size), NULL;
+
+	return b;
+}
+
+/*
+ * Anything else (pipes, mostly) is read a chunk at a time until it
+ * runs dry. The text has to stick around after it's been lexed, since
+ * error messages quote it, so it all goes in one growing buffer.
+ */
+
+static char *
+read_stream(int fd, size_t *len)
+{
+	size_t cap = 1 << 16, num = 0;
+	char *b = malloc(cap);
+	if (!b) return NULL;
+
+	for (;;) {
+		if (cap - num < 1 << 16) {
+			char *n = realloc(b, cap *= 2);
+			if (!n) return free(b), NULL;
+			b = n;
+		}
+
+		ssize_t r = read(fd, b + num, cap - num - 1);
+		if (r < 0) return free(b), NULL;
+		if (!r) break;
+		num += r;
+	}
+
+	b[num] = 0;
+	*len = num;
+
+	return b;
+}
+
+/*
+ * Loads the file at `p`, or standard input if `p` is "-". The text is
+ * NUL-terminated and its length (without the NUL) goes in `len`. The
+ * result is read-only.
+ */
+
+char *
+load_file(const char *p, size_t *len)
+{
+	int fd = strcmp(p, "-") ? open(p, O_RDONLY) : STDIN_FILENO;
+	if (fd < 0) return NULL;
+
+	struct stat st;
+	char *b;
+
+	if (fstat(fd, &st)) b = NULL;
+	else if (S_ISREG(st.st_mode)) b = map_file(fd, *len = st.st_size);
+	else b = read_stream(fd, len);
+
+	if (fd != STDIN_FILENO) close(fd);
+
+	return b;
+}
+
+/*
+ * Like `load_file()`, but always reads the file into memory. A mapped
+ * file that's written to while it's in use changes underneath us, or
+ * goes away altogether if it's truncated.
+ */
+
 char *
-load_file(const char *p)
+read_file(const char *p, size_t *len)
 {
-	char *b = NULL;
-	FILE *f = NULL;
-	int len = -1;
-
-	f = fopen(p, "rb");
-	if (!f) return NULL;
-	if (fseek(f, 0L, SEEK_END)) return fclose(f), NULL;
-	len = ftell(f);
-	if (len == -1) return fclose(f), NULL;
-	b = malloc(len + 10);
-	if (!b) return fclose(f), NULL;
-	if (fseek(f, 0L, SEEK_SET)) return fclose(f), free(b), NULL;
-	len = fread(b, 1, len, f);
-	if (ferror(f)) return fclose(f), free(b), NULL;
-	fclose(f);
-	memset(b + len, 0, 10);
+	int fd = open(p, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	char *b = read_stream(fd, len);
+	close(fd);
 
 	return b;
 }
@@ -5,6 +5,9 @@
                      || X == 'U' || X == 'Y' || X == 'a' || X == 'e'	\
                      || X == 'i' || X == 'o' || X == 'u' || X == 'y')
 
-char *load_file(const char *p);
+#include <stddef.h>
+
+char *load_file(const char *p, size_t *len);
+char *read_file(const char *p, size_t *len);
 
 #endif
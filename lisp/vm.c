@@ -0,0 +1,321 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "gc.h"
+#include "vm.h"
+#include "eval.h"
+#include "lisp.h"
+#include "profile.h"
+
+#define STACK_SIZE (1 << 18)
+
+bool use_vm = false;
+
+/*
+ * The VM. It's a stack machine: operands and temporaries live on
+ * `stack`, while variables live in the same heap frames that `eval()`
+ * uses, so that closures work the same way in both and the two can
+ * call back and forth freely.
+ *
+ * Each active call has a record saying which code it's running and
+ * where its result should go. `fn` keeps the function (and with it
+ * the code) alive while it runs; it's NULL for top-level code.
+ */
+
+struct call {
+	struct code *code;
+	struct value *fn;
+	struct value *env;
+	int *ip;
+	unsigned base;
+};
+
+static struct value *stack[STACK_SIZE];
+static unsigned sp;
+
+static struct call *calls;
+static unsigned num_call, cap_call;
+
+static void
+walk_vm(gc_visitor *visit)
+{
+	for (unsigned i = 0; i < sp; i++)
+		visit(&stack[i]);
+
+	for (unsigned i = 0; i < num_call; i++) {
+		visit(&calls[i].fn);
+		visit(&calls[i].env);
+		trace_code(calls[i].code, visit);
+	}
+}
+
+static struct call *
+push_call(struct code *code,
+          struct value *fn,
+          struct value *env,
+          unsigned base)
+{
+	if (!cap_call) gc_roots(walk_vm);
+
+	if (num_call == cap_call) {
+		cap_call = cap_call ? cap_call * 2 : 64;
+		calls = realloc(calls, cap_call * sizeof *calls);
+	}
+
+	calls[num_call] = (struct call){ code, fn, env, code->op, base };
+
+	return &calls[num_call++];
+}
+
+/*
+ * Code that was replaced while it might still have been running. It's
+ * freed once the VM has nothing left on its stack.
+ */
+
+static struct code *retired;
+
+static void
+flush_retired(void)
+{
+	if (num_call) return;
+
+	while (retired) {
+		struct code *c = retired;
+		retired = c->next;
+		free_code(c);
+	}
+}
+
+/*
+ * Returns the code for the function `fn`, compiling it if that hasn't
+ * been done yet or if it expanded a macro that's since changed.
+ */
+
+static struct code *
+code_of(struct value *fn)
+{
+	struct code *c = fn->code;
+
+	if (c && c->epoch != macro_epoch && !c->expanded)
+		c->epoch = macro_epoch;
+	if (c && c->epoch == macro_epoch) return c;
+
+	if (c) {
+		c->next = retired;
+		retired = c;
+		fn->code = NULL;
+	}
+
+	PROTECT(&fn);
+	c = compile(fn->env, fn->body, fn->loc);
+	fn->code = c;
+
+	return c;
+}
+
+/*
+ * Runs `code` in the frame `env` until it returns.
+ */
+
+static struct value *
+run(struct code *code, struct value *fn, struct value *env)
+{
+	static void *dispatch[] = {
+		[OP_CONST]     = &&op_const,
+		[OP_LOCAL]     = &&op_local,
+		[OP_SETLOCAL]  = &&op_setlocal,
+		[OP_GLOBAL]    = &&op_global,
+		[OP_SETGLOBAL] = &&op_setglobal,
+		[OP_POP]       = &&op_pop,
+		[OP_JUMP]      = &&op_jump,
+		[OP_JUMPF]     = &&op_jumpf,
+		[OP_CALL]      = &&op_call,
+		[OP_TAILCALL]  = &&op_call,
+		[OP_RETURN]    = &&op_return,
+		[OP_EVAL]      = &&op_eval,
+	};
+
+	unsigned entry = num_call, base, n;
+	struct call *f = push_call(code, fn, env, sp);
+	struct value *r, *e, **bind;
+	struct value **k = code->k;
+	int *ip = code->op;
+	int tail;
+	PROFILE_MARK(mark);
+
+#define NEXT goto *dispatch[*ip++]
+#define HERE (f->code->loc[ip - f->code->op - 1])
+#define PUSH(X)	  \
+	do { \
+		if (sp == STACK_SIZE) { \
+			r = error(HERE, "stack overflow"); \
+			goto fail; \
+		} \
+		stack[sp++] = (X); \
+	} while (0)
+
+	/*
+	 * Anything that can run arbitrary code can grow `calls`, so
+	 * `f` has to be looked up again afterwards.
+	 */
+
+#define RELOAD (f = &calls[num_call - 1])
+
+	NEXT;
+
+op_const:
+	PUSH(k[*ip++]);
+	NEXT;
+
+op_local:
+	e = f->env;
+	for (int d = ip[0]; d; d--) e = e->up;
+	PUSH(e->slot[ip[1]]);
+	ip += 2;
+	NEXT;
+
+op_setlocal:
+	e = f->env;
+	for (int d = ip[0]; d; d--) e = e->up;
+	assign(&e->slot[ip[1]], stack[sp - 1]);
+	ip += 2;
+	NEXT;
+
+op_global:
+	bind = find(f->env, k[*ip++]);
+	if (!bind) {
+		r = error(HERE, "undeclared identifier");
+		goto fail;
+	}
+	PUSH(*bind);
+	NEXT;
+
+op_setglobal:
+	bind = find(f->env, k[*ip++]);
+	if (bind) assign(bind, stack[sp - 1]);
+	else add_variable(f->env, k[ip[-1]], stack[sp - 1]);
+	note_binding(f->env, k[ip[-1]], HERE);
+	NEXT;
+
+op_pop:
+	sp--;
+	NEXT;
+
+op_jump:
+	ip = f->code->op + *ip;
+	NEXT;
+
+op_jumpf:
+	if (TYPE(stack[--sp]) != VAL_TRUE) ip = f->code->op + *ip;
+	else ip++;
+	NEXT;
+
+op_call:
+	tail = ip[-1] == OP_TAILCALL;
+	n = *ip++;
+	base = sp - n - 1;
+
+	if (TYPE(stack[base]) != VAL_FUNCTION) {
+		r = invoke(f->env, HERE, stack[base], n, stack + base + 1);
+		RELOAD;
+		if (TYPE(r) == VAL_ERROR) goto fail;
+		sp = base;
+		PUSH(r);
+		if (tail) goto op_return;
+		NEXT;
+	}
+
+	/*
+	 * A tail call replaces the current call, so the function and
+	 * its arguments are moved down to where its result would go.
+	 */
+
+	if (tail) {
+		memmove(stack + f->base, stack + base,
+		        (n + 1) * sizeof *stack);
+		base = f->base;
+		sp = base + n + 1;
+	} else {
+		f->ip = ip;
+	}
+
+	code_of(stack[base]);
+	r = make_frame(stack[base], n, stack + base + 1);
+	RELOAD;
+	sp = base;
+
+	/* Top-level code isn't a call, so there's nothing to replace. */
+	if (profiling) profile_call(stack[base], tail && f->fn);
+
+	if (tail) {
+		f->code = stack[base]->code;
+		f->fn = stack[base];
+		f->env = r;
+	} else {
+		f = push_call(stack[base]->code, stack[base], r, base);
+	}
+
+	ip = f->code->op;
+	k = f->code->k;
+	NEXT;
+
+op_return:
+	r = stack[sp - 1];
+	sp = f->base;
+	if (--num_call == entry) return r;
+	if (profiling) profile_pop(profile_depth - 1);
+	RELOAD;
+	stack[sp++] = r;
+	ip = f->ip;
+	k = f->code->k;
+	NEXT;
+
+op_eval:
+	r = eval(f->env, k[*ip++]);
+	RELOAD;
+	if (TYPE(r) == VAL_ERROR) goto fail;
+	PUSH(r);
+	NEXT;
+
+fail:
+	sp = calls[entry].base;
+	num_call = entry;
+	return r;
+
+#undef NEXT
+#undef HERE
+#undef PUSH
+#undef RELOAD
+}
+
+/*
+ * Compiles and runs the top-level form `v`.
+ */
+
+struct value *
+vm_eval(struct value *env, struct value *v)
+{
+	PROTECT(&env);
+	struct value *body = cons(v, Nil);
+	struct code *code = compile(env, body, body->loc);
+	struct value *r = run(code, NULL, env);
+	free_code(code);
+	flush_retired();
+	return r;
+}
+
+/*
+ * Runs the body of the function `fn` in `frame`, which already holds
+ * its arguments.
+ */
+
+struct value *
+vm_apply(struct value *fn, struct value *frame)
+{
+	PROTECT(&fn, &frame);
+	struct code *code = code_of(fn);
+	struct value *r = run(code, fn, frame);
+	flush_retired();
+	return r;
+}
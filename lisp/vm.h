@@ -0,0 +1,61 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdbool.h>
+#include "lisp.h"
+#include "gc.h"
+
+/*
+ * The bytecode. Every instruction is an opcode followed by its
+ * operands, all stored as `int`s. `A` names a constant, `D I` a slot
+ * `I` in the frame `D` levels up, `T` an instruction to jump to and
+ * `N` a number of arguments.
+ */
+
+enum {
+	OP_CONST,     /* A    push constant A                      */
+	OP_LOCAL,     /* D I  push a slot                          */
+	OP_SETLOCAL,  /* D I  store the top of the stack in a slot */
+	OP_GLOBAL,    /* A    push the value of the symbol A       */
+	OP_SETGLOBAL, /* A    assign the top of the stack to A     */
+	OP_POP,       /*      discard the top of the stack         */
+	OP_JUMP,      /* T    jump                                 */
+	OP_JUMPF,     /* T    pop, jump unless it was `t'          */
+	OP_CALL,      /* N    call a function with N arguments     */
+	OP_TAILCALL,  /* N    call and return its result           */
+	OP_RETURN,    /*      return the top of the stack          */
+	OP_EVAL,      /* A    hand the form A to `eval()'          */
+};
+
+/*
+ * A compiled function body or top-level form. None of this lives in
+ * the heap; the constants are kept alive by whatever owns the code.
+ */
+
+struct code {
+	int *op;                 /* Instructions and their operands. */
+	location *loc;   /* Source location of each word.    */
+	unsigned num_op, cap_op;
+
+	struct value **k;        /* Constants.                       */
+	unsigned num_k, cap_k;
+
+	unsigned epoch;          /* `macro_epoch' when compiled.     */
+	bool expanded;           /* Whether any macros were used.    */
+
+	struct code *next;       /* See `compiling' in compile.c.    */
+};
+
+/* Set by `--vm'; functions called from `eval()' then run compiled. */
+extern bool use_vm;
+
+struct code *compile(struct value *env,
+                     struct value *body,
+                     location loc);
+void free_code(struct code *c);
+void trace_code(struct code *c, gc_visitor *visit);
+
+struct value *vm_eval(struct value *env, struct value *v);
+struct value *vm_apply(struct value *fn, struct value *frame);
+
+#endif
@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+
+#include "watch.h"
+
+/*
+ * Watches files for changes with inotify. It's the directory a file
+ * is in that's watched rather than the file itself, since most editors
+ * save by writing a new file and renaming it over the old one, which
+ * leaves a watch on the old file watching nothing.
+ */
+
+struct watched {
+	int wd;                /* Watch descriptor of the directory. */
+	char *name;            /* Name of the file in the directory. */
+};
+
+struct watcher {
+	int fd;
+	struct watched *file;
+	unsigned num_file;
+};
+
+/*
+ * How long things have to go quiet before a change is reported, in
+ * milliseconds. Saving a file is often a burst of several events.
+ */
+
+#define SETTLE 5
+
+struct watcher *
+new_watcher(void)
+{
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0) return NULL;
+
+	struct watcher *w = calloc(1, sizeof *w);
+	w->fd = fd;
+
+	return w;
+}
+
+bool
+add_watch(struct watcher *w, const char *path)
+{
+	char *d = strdup(path), *b = strdup(path);
+	int wd = inotify_add_watch(w->fd, dirname(d),
+	                           IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+
+	if (wd < 0) return free(d), free(b), false;
+
+	w->file = realloc(w->file, (w->num_file + 1) * sizeof *w->file);
+	w->file[w->num_file++] = (struct watched){ wd, strdup(basename(b)) };
+	free(d), free(b);
+
+	return true;
+}
+
+/*
+ * Blocks until something changes and returns the index of the first
+ * file to have been added that's changed since the last call, or -1 if
+ * something's gone wrong.
+ */
+
+int
+next_change(struct watcher *w)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int timeout = -1, r = -1;
+	struct pollfd p = { w->fd, POLLIN, 0 };
+
+	for (;;) {
+		int n = poll(&p, 1, timeout);
+		if (n < 0) return -1;
+		if (!n) return r;
+
+		ssize_t len = read(w->fd, buf, sizeof buf);
+		if (len <= 0) return -1;
+
+		for (char *e = buf; e < buf + len;) {
+			struct inotify_event *ev = (struct inotify_event *)e;
+			e += sizeof *ev + ev->len;
+			if (!ev->len) continue;
+
+			for (unsigned i = 0; i < w->num_file; i++)
+				if (w->file[i].wd == ev->wd
+				    && !strcmp(w->file[i].name, ev->name)
+				    && (r < 0 || (int)i < r))
+					r = i;
+		}
+
+		if (r >= 0) timeout = SETTLE;
+	}
+}
+
+void
+free_watcher(struct watcher *w)
+{
+	for (unsigned i = 0; i < w->num_file; i++) free(w->file[i].name);
+	close(w->fd);
+	free(w->file);
+	free(w);
+}
@@ -0,0 +1,11 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdbool.h>
+
+struct watcher *new_watcher(void);
+bool add_watch(struct watcher *w, const char *path);
+int next_change(struct watcher *w);
+void free_watcher(struct watcher *w);
+
+#endif